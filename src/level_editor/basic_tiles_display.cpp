@@ -24,7 +24,7 @@ void level_editor::basic_tiles_display::update_all() {
     return;
 
   Cairo::RefPtr<Cairo::Context> context = Cairo::Context::create(m_surface);
-  tile_buf& buf = get_tile_buf();
+  const tile_buf& buf = get_tile_buf();
   const int width = buf.get_width();
   const int height = buf.get_height();
   for (int x = 0; x < width; ++x) {
@@ -5,16 +5,16 @@ using namespace Graal;
 
 level_editor::basic_cache::~basic_cache() {}
 
-level_editor::tiles_cache::tiles_cache(Graal::tile_buf& tile_buf) {
-  m_tile_buf.swap(tile_buf);
-}
+level_editor::tiles_cache::tiles_cache(BOOST_RV_REF(Graal::tile_buf) tile_buf):
+  m_tile_buf(boost::move(tile_buf)) {}
 
 void level_editor::tiles_cache::paste(level_display& target) {
   int x, y;
   target.get_pointer(x, y);
 
+  // Only copies row pointers, the cache can be pasted again
   Graal::tile_buf buf(m_tile_buf);
-  target.drag_selection(buf, 0, 0);
+  target.drag_selection(boost::move(buf), 0, 0);
 }
 
 level_editor::npc_cache::npc_cache(const Graal::npc& npc): m_npc(npc) {}
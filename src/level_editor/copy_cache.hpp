@@ -14,7 +14,7 @@ namespace Graal {
 
     class tiles_cache : public basic_cache {
     public:
-      tiles_cache(Graal::tile_buf& tile_buf);
+      tiles_cache(BOOST_RV_REF(Graal::tile_buf) tile_buf);
       virtual void paste(level_display& target);
     protected:
       tile_buf m_tile_buf;
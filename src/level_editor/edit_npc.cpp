@@ -72,7 +72,7 @@ level_editor::edit_npc::~edit_npc() {}
 
 void level_editor::edit_npc::set(const npc& _npc) {
   m_npc = _npc;
-  m_edit_image.set_text(_npc.image);
+  m_edit_image.set_text(_npc.image.get_name());
   m_edit_x.set_text(boost::lexical_cast<std::string>(_npc.get_level_x()));
   m_edit_y.set_text(boost::lexical_cast<std::string>(_npc.get_level_y()));
 
@@ -82,7 +82,7 @@ void level_editor::edit_npc::set(const npc& _npc) {
 
 npc level_editor::edit_npc::get_npc() {
   npc new_npc(m_npc);
-  new_npc.image = m_edit_image.get_text();
+  new_npc.image = image_handle(m_edit_image.get_text());
   float new_x, new_y;
   helper::parse<float>(m_edit_x.get_text(), new_x);
   new_npc.set_level_x(new_x);
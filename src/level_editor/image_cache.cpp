@@ -84,8 +84,20 @@ image_cache::image_ptr& image_cache::get_image(const std::string& file_name) {
   return image;
 } 
 
+image_cache::image_ptr& image_cache::get_image(const image_handle& image) {
+  const std::size_t id = image.get_id();
+  if (id >= m_handle_cache.size())
+    m_handle_cache.resize(id + 1);
+
+  image_ptr& cached = m_handle_cache[id];
+  if (!cached)
+    cached = get_image(image.get_name());
+  return cached;
+}
+
 void image_cache::clear_cache() {
   m_cache.clear();
+  m_handle_cache.clear();
   m_cache[""] = m_npc_image;
   load_internal_images();
   m_signal_cache_update.emit();
@@ -97,7 +109,10 @@ image_cache::signal_cache_update_type& image_cache::signal_cache_update() {
 
 void image_cache::load_internal_images() {
   const char** p = image_data::images;
-  Glib::RefPtr<Gtk::IconTheme> theme = Gtk::IconTheme::get_default();
+  // There is no icon theme without a display, when rendering from the command line
+  Glib::RefPtr<Gtk::IconTheme> theme;
+  if (Gdk::Screen::get_default())
+    theme = Gtk::IconTheme::get_default();
   while (*p) {
     const char* name  = *(p++);
     const char* begin = *(p++);
@@ -109,7 +124,7 @@ void image_cache::load_internal_images() {
     image_ptr image = m_cache[name] = Cairo::ImageSurface::create_from_png(my_read_func, &state);
 
     static const char toolbar_prefix[] = "internal/toolbar_";
-    if (std::strncmp(name, toolbar_prefix, sizeof(toolbar_prefix) - 1) == 0) {
+    if (theme && std::strncmp(name, toolbar_prefix, sizeof(toolbar_prefix) - 1) == 0) {
       const guint8* surface_data = image->get_data();
       guint8* data = static_cast<guint8*>(g_malloc(32 * 32 * 4));
       int stride = image->get_stride();
@@ -3,11 +3,14 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <sigc++/signal.h>
 #include <cairomm/surface.h>
 
+#include "image_handle.hpp"
+
 namespace Graal {
   namespace level_editor {
     class filesystem;
@@ -16,11 +19,14 @@ namespace Graal {
     public:
       typedef Cairo::RefPtr<Cairo::ImageSurface> image_ptr;
       typedef std::map<std::string, image_ptr> image_map_type;
+      typedef std::vector<image_ptr> image_handle_list_type;
       typedef sigc::signal<void> signal_cache_update_type;
 
       image_cache(filesystem& fs);
 
       image_ptr& get_image(const std::string& file_name);
+      // Same as above, but looks the image up by handle after the first call
+      image_ptr& get_image(const image_handle& image);
 
       void clear_cache();
 
@@ -31,6 +37,8 @@ namespace Graal {
 
       filesystem& m_fs;
       image_map_type m_cache;
+      // Images by handle id, empty entries weren't requested yet
+      image_handle_list_type m_handle_cache;
       image_ptr m_default_image;
       image_ptr m_npc_image;
 
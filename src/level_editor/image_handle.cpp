@@ -0,0 +1,47 @@
+#include "image_handle.hpp"
+
+#include <glibmm/threads.h>
+#include <deque>
+#include <map>
+
+namespace {
+  /* Names by id and ids by name, the empty name always has id 0. Level
+   * snapshots resolve names off the main thread, so the table is locked
+   * and names never move once added */
+  struct name_table {
+    std::deque<std::string> names;
+    std::map<std::string, std::size_t> ids;
+    Glib::Threads::Mutex mutex;
+
+    name_table() {
+      names.push_back("");
+      ids[""] = 0;
+    }
+  };
+
+  name_table& get_name_table() {
+    static name_table table;
+    return table;
+  }
+}
+
+Graal::image_handle::image_handle(const std::string& name) {
+  name_table& table = get_name_table();
+  Glib::Threads::Mutex::Lock lock(table.mutex);
+
+  std::map<std::string, std::size_t>::iterator iter = table.ids.find(name);
+  if (iter != table.ids.end()) {
+    m_id = iter->second;
+    return;
+  }
+
+  m_id = table.names.size();
+  table.names.push_back(name);
+  table.ids[name] = m_id;
+}
+
+const std::string& Graal::image_handle::get_name() const {
+  name_table& table = get_name_table();
+  Glib::Threads::Mutex::Lock lock(table.mutex);
+  return table.names[m_id];
+}
@@ -0,0 +1,28 @@
+#ifndef GRAAL_LEVEL_EDITOR_IMAGE_HANDLE_HPP_
+#define GRAAL_LEVEL_EDITOR_IMAGE_HANDLE_HPP_
+
+#include <cstddef>
+#include <string>
+
+namespace Graal {
+  /* An interned image file name. Equal names get the same handle, so
+   * caches can be indexed by get_id() instead of comparing strings. Ids are
+   * dense, starting at 0 for the empty name */
+  class image_handle {
+  public:
+    image_handle(): m_id(0) {}
+    explicit image_handle(const std::string& name);
+
+    const std::string& get_name() const;
+    std::size_t get_id() const { return m_id; }
+
+    bool empty() const { return m_id == 0; }
+
+    bool operator==(const image_handle& o) const { return m_id == o.m_id; }
+    bool operator!=(const image_handle& o) const { return m_id != o.m_id; }
+  private:
+    std::size_t m_id;
+  };
+}
+
+#endif
@@ -1,14 +1,159 @@
 #include "level.hpp"
 #include "helper.hpp"
 #include <fstream>
+#include <boost/functional/hash.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
+#include <glibmm/threads.h>
 #include <string>
 #include <iostream>
 
 using namespace Graal::helper;
 
-Graal::level::level(int fill_tile): m_unique_npc_id_counter(0) {
+namespace {
+  // Enough rows for a few dozen levels with several layers
+  const std::size_t max_free_rows = 16384;
+}
+
+std::vector<Graal::tile_row*> Graal::tile_row_pool::s_free_rows;
+
+namespace {
+  // Rows of level snapshots are freed on whatever thread drops them last
+  Glib::Threads::Mutex& get_free_rows_mutex() {
+    static Glib::Threads::Mutex mutex;
+    return mutex;
+  }
+}
+
+Graal::tile_row_ptr Graal::tile_row_pool::create(std::size_t width, const tile& fill_tile) {
+  tile_row* row = take();
+  row->assign(width, fill_tile);
+  return wrap(row);
+}
+
+Graal::tile_row_ptr Graal::tile_row_pool::copy(const tile_row& row) {
+  tile_row* new_row = take();
+  new_row->assign(row.begin(), row.end());
+  return wrap(new_row);
+}
+
+void Graal::tile_row_pool::clear() {
+  Glib::Threads::Mutex::Lock lock(get_free_rows_mutex());
+  std::vector<tile_row*>::iterator iter, end = s_free_rows.end();
+  for (iter = s_free_rows.begin(); iter != end; ++iter)
+    delete *iter;
+  s_free_rows.clear();
+}
+
+void Graal::tile_row_pool::recycle_row::operator()(tile_row* row) const {
+  {
+    Glib::Threads::Mutex::Lock lock(get_free_rows_mutex());
+    if (s_free_rows.size() < max_free_rows) {
+      s_free_rows.push_back(row);
+      return;
+    }
+  }
+  delete row;
+}
+
+Graal::tile_row_ptr Graal::tile_row_pool::wrap(tile_row* row) {
+  // The reference count is pooled as well
+  return tile_row_ptr(row, recycle_row(), boost::fast_pool_allocator<tile_row>());
+}
+
+Graal::tile_row* Graal::tile_row_pool::take() {
+  {
+    Glib::Threads::Mutex::Lock lock(get_free_rows_mutex());
+    if (!s_free_rows.empty()) {
+      tile_row* row = s_free_rows.back();
+      s_free_rows.pop_back();
+      return row;
+    }
+  }
+  return new tile_row();
+}
+
+Graal::compressed_tile_buf::compressed_tile_buf(const tile_buf& tiles):
+  width(tiles.get_width()), height(tiles.get_height())
+{
+  for (int y = 0; y < height; ++y) {
+    const tile* row = tiles.get_row(y);
+    for (int x = 0; x < width; ++x) {
+      const boost::int16_t index = static_cast<boost::int16_t>(row[x].index);
+      if (!runs.empty() && runs.back().index == index && runs.back().length < 0xffff) {
+        ++runs.back().length;
+      } else {
+        run new_run = { 1, index };
+        runs.push_back(new_run);
+      }
+    }
+  }
+}
+
+void Graal::compressed_tile_buf::decompress(tile_buf& tiles, tile_row_store* row_store) const {
+  tiles.resize(width, height);
+
+  std::vector<run>::const_iterator iter = runs.begin();
+  int left = iter != runs.end() ? iter->length : 0;
+  for (int y = 0; y < height; ++y) {
+    tile* row = tiles.get_row(y);
+    for (int x = 0; x < width; ++x) {
+      row[x].index = iter->index;
+      if (--left == 0 && ++iter != runs.end())
+        left = iter->length;
+    }
+
+    if (row_store)
+      tiles.intern_row(y, *row_store);
+  }
+}
+
+Graal::tile_row_store::tile_row_store(): m_purge_size(1024) {}
+
+Graal::tile_row_ptr Graal::tile_row_store::intern(const tile_row_ptr& row) {
+  const std::size_t hash = hash_row(*row);
+
+  std::pair<row_map_type::iterator, row_map_type::iterator> range = m_rows.equal_range(hash);
+  for (row_map_type::iterator iter = range.first; iter != range.second; ++iter) {
+    tile_row_ptr stored = iter->second.lock();
+    if (stored && (stored == row || *stored == *row))
+      return stored;
+  }
+
+  // Forget freed rows once the store doubled in size since the last purge
+  if (m_rows.size() >= m_purge_size) {
+    purge();
+    m_purge_size = std::max(m_purge_size, m_rows.size() * 2);
+  }
+
+  m_rows.insert(std::make_pair(hash, boost::weak_ptr<tile_row>(row)));
+  return row;
+}
+
+std::size_t Graal::tile_row_store::hash_row(const tile_row& row) {
+  std::size_t hash = 0;
+  for (tile_row::const_iterator iter = row.begin(); iter != row.end(); ++iter)
+    boost::hash_combine(hash, iter->index);
+  return hash;
+}
+
+void Graal::tile_row_store::purge() {
+  row_map_type::iterator iter = m_rows.begin();
+  while (iter != m_rows.end()) {
+    if (iter->second.expired())
+      m_rows.erase(iter++);
+    else
+      ++iter;
+  }
+}
+
+Graal::level::level(int fill_tile):
+  m_unique_npc_id_counter(0),
+  m_tiles_hash(0),
+  m_objects_hash(0),
+  m_objects_hash_valid(false),
+  m_hashed_object_count(0)
+{
   // Always create one layer
   create_tiles(0, fill_tile);
 
@@ -17,27 +162,30 @@ Graal::level::level(int fill_tile): m_unique_npc_id_counter(0) {
   g_assert(Graal::tile_invalid.index == Graal::tile::invalid_index);
 }
 
-int Graal::level::get_width() const {
-  return 64;
-}
-
-int Graal::level::get_height() const {
-  return 64;
-}
-
 Graal::npc& Graal::level::add_npc() {
   Graal::npc npc;
   npc.id = ++m_unique_npc_id_counter;
   npcs.push_back(npc);
+  hash_object(npcs.back());
   return npcs.back();
 }
 
-Graal::npc& Graal::level::add_npc(Graal::npc npc) {
-  npc.id = ++m_unique_npc_id_counter;
+Graal::npc& Graal::level::add_npc(const Graal::npc& npc) {
   npcs.push_back(npc);
+  npcs.back().id = ++m_unique_npc_id_counter;
+  hash_object(npcs.back());
   return npcs.back();
 }
 
+Graal::npc& Graal::level::add_npc(BOOST_RV_REF(Graal::npc) npc) {
+  npcs.push_back(Graal::npc());
+  Graal::npc& new_npc = npcs.back();
+  new_npc = boost::move(npc);
+  new_npc.id = ++m_unique_npc_id_counter;
+  hash_object(new_npc);
+  return new_npc;
+}
+
 Graal::level::npc_list_type::iterator Graal::level::get_npc(int id) {
   npc_list_type::iterator it, end = npcs.end();
   for (it = npcs.begin(); it != end; ++it) {
@@ -49,7 +197,105 @@ Graal::level::npc_list_type::iterator Graal::level::get_npc(int id) {
 }
 
 void Graal::level::delete_npc(int id) {
-  npcs.erase(get_npc(id));
+  npc_list_type::iterator iter = get_npc(id);
+  unhash_object(*iter);
+  npcs.erase(iter);
+}
+
+void Graal::level::take_npc(int id, Graal::npc& result) {
+  npc_list_type::iterator iter = get_npc(id);
+  unhash_object(*iter);
+  result = boost::move(*iter);
+  npcs.erase(iter);
+}
+
+void Graal::level::update_npc(npc_list_type::iterator iter, const Graal::npc& npc) {
+  const int id = iter->id;
+  unhash_object(*iter);
+  *iter = npc;
+  iter->id = id;
+  hash_object(*iter);
+}
+
+Graal::level::link_list_type::iterator Graal::level::add_link(const Graal::link& _link) {
+  update_object_index();
+  link_list_type::iterator iter = links.insert(links.end(), _link);
+  index_link(iter);
+  hash_object(*iter);
+  return iter;
+}
+
+void Graal::level::delete_link(link_list_type::iterator iter) {
+  unhash_object(*iter);
+  m_link_grid.remove(iter);
+  links.erase(iter);
+}
+
+void Graal::level::update_link(link_list_type::iterator iter, const Graal::link& _link) {
+  update_object_index();
+  unhash_object(*iter);
+  m_link_grid.remove(iter);
+  *iter = _link;
+  index_link(iter);
+  hash_object(*iter);
+}
+
+Graal::level::sign_list_type::iterator Graal::level::add_sign(const Graal::sign& _sign) {
+  update_object_index();
+  sign_list_type::iterator iter = signs.insert(signs.end(), _sign);
+  index_sign(iter);
+  hash_object(*iter);
+  return iter;
+}
+
+void Graal::level::delete_sign(sign_list_type::iterator iter) {
+  unhash_object(*iter);
+  m_sign_grid.remove(iter);
+  signs.erase(iter);
+}
+
+void Graal::level::update_sign(sign_list_type::iterator iter, const Graal::sign& _sign) {
+  update_object_index();
+  unhash_object(*iter);
+  m_sign_grid.remove(iter);
+  *iter = _sign;
+  index_sign(iter);
+  hash_object(*iter);
+}
+
+void Graal::level::find_links(int x, int y, int width, int height, link_query_type& result) {
+  update_object_index();
+  m_link_grid.find(x, y, width, height, result);
+}
+
+void Graal::level::find_signs(int x, int y, int width, int height, sign_query_type& result) {
+  update_object_index();
+  m_sign_grid.find(x, y, width, height, result);
+}
+
+void Graal::level::index_link(link_list_type::iterator iter) {
+  m_link_grid.insert(iter, iter->x, iter->y, iter->width, iter->height);
+}
+
+void Graal::level::index_sign(sign_list_type::iterator iter) {
+  // Signs are by default 2x1 tiles big
+  m_sign_grid.insert(iter, iter->x, iter->y, 2, 1);
+}
+
+void Graal::level::update_object_index() {
+  /* Cheap consistency check in case someone bypassed add_link/add_sign, a
+   * full rebuild is only a few hundred insertions at most */
+  if (!m_link_grid.valid() || m_link_grid.size() != links.size()) {
+    m_link_grid.reset(get_width(), get_height());
+    for (link_list_type::iterator it = links.begin(); it != links.end(); ++it)
+      index_link(it);
+  }
+
+  if (!m_sign_grid.valid() || m_sign_grid.size() != signs.size()) {
+    m_sign_grid.reset(get_width(), get_height());
+    for (sign_list_type::iterator it = signs.begin(); it != signs.end(); ++it)
+      index_sign(it);
+  }
 }
 
 Graal::tile_buf& Graal::level::create_tiles(int layer, int fill_tile, bool overwrite) {
@@ -66,12 +312,8 @@ Graal::tile_buf& Graal::level::create_tiles(int layer, int fill_tile, bool overw
 
   tile_buf& tiles = layers[layer];
   tiles.resize(get_width(), get_height());
-
-  for (int x = 0; x < get_width(); x ++) {
-    for (int y = 0; y < get_height(); y ++) {
-      tiles.get_tile(x, y).index = fill_tile;
-    }
-  }
+  tiles.fill(tile(fill_tile));
+  update_tiles_hash(layer, 0, get_height());
 
   return tiles;
 }
@@ -99,13 +341,182 @@ int Graal::level::get_layer_count() const {
 void Graal::level::insert_layer(int index, int fill_tile) {
   layers.insert(layers.begin() + index, Graal::tile_buf());
   create_tiles(index, fill_tile, true);
+  // Layer numbers are part of the tile keys
+  m_row_hashes.clear();
 }
 
 void Graal::level::delete_layer(int index) {
   layers.erase(layers.begin() + index);
+  m_row_hashes.clear();
 }
 
-Graal::level* Graal::load_nw_level(const boost::filesystem::path& path) {
+namespace {
+  // splitmix64 finalizer, spreads a key over all bits
+  inline boost::uint64_t mix(boost::uint64_t key) {
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+  }
+
+  inline boost::uint64_t tile_key(int layer, int x, int y, int index) {
+    return mix((static_cast<boost::uint64_t>(layer & 0xffff) << 48) |
+               (static_cast<boost::uint64_t>(y & 0xffff) << 32) |
+               (static_cast<boost::uint64_t>(x & 0xffff) << 16) |
+                static_cast<boost::uint64_t>(index & 0xffff));
+  }
+
+  boost::uint64_t hash_row(const Graal::tile* row, int width, int layer, int y) {
+    boost::uint64_t hash = 0;
+    for (int x = 0; x < width; ++x) {
+      if (row[x].index != Graal::tile::transparent_index)
+        hash ^= tile_key(layer, x, y, row[x].index);
+    }
+    return hash;
+  }
+
+  // The n-th of several equal objects gets a key of its own
+  inline boost::uint64_t occurrence_key(boost::uint64_t key, int n) {
+    return mix(key + static_cast<boost::uint64_t>(n) * 0x9e3779b97f4a7c15ULL);
+  }
+
+  boost::uint64_t object_key(const Graal::link& _link) {
+    std::size_t seed = 0;
+    boost::hash_combine(seed, 'l');
+    boost::hash_combine(seed, _link.x);
+    boost::hash_combine(seed, _link.y);
+    boost::hash_combine(seed, _link.width);
+    boost::hash_combine(seed, _link.height);
+    boost::hash_combine(seed, _link.new_x);
+    boost::hash_combine(seed, _link.new_y);
+    boost::hash_combine(seed, _link.destination);
+    return mix(seed);
+  }
+
+  boost::uint64_t object_key(const Graal::sign& _sign) {
+    std::size_t seed = 0;
+    boost::hash_combine(seed, 's');
+    boost::hash_combine(seed, _sign.x);
+    boost::hash_combine(seed, _sign.y);
+    boost::hash_combine(seed, _sign.text);
+    return mix(seed);
+  }
+
+  // NPC ids only exist while editing
+  boost::uint64_t object_key(const Graal::npc& npc) {
+    std::size_t seed = 0;
+    boost::hash_combine(seed, 'n');
+    boost::hash_combine(seed, npc.x);
+    boost::hash_combine(seed, npc.y);
+    boost::hash_combine(seed, npc.image.get_name());
+    boost::hash_combine(seed, npc.script);
+    return mix(seed);
+  }
+}
+
+boost::uint64_t Graal::level::get_content_hash() {
+  // Hash new layers, or all of them after layers were inserted or deleted
+  if (m_row_hashes.empty())
+    m_tiles_hash = 0;
+  for (int layer = static_cast<int>(m_row_hashes.size()); layer < get_layer_count(); ++layer) {
+    m_row_hashes.push_back(row_hash_list_type());
+    update_tiles_hash(layer, 0, get_height());
+  }
+
+  // Cheap check in case someone added or removed objects directly
+  if (!m_objects_hash_valid ||
+      m_hashed_object_count != links.size() + signs.size() + npcs.size())
+    update_objects_hash();
+
+  return m_tiles_hash ^ m_objects_hash;
+}
+
+void Graal::level::update_tiles_hash(int layer, int y, int height) {
+  if (layer < 0 || layer >= static_cast<int>(m_row_hashes.size()))
+    return; // Hashed once the hash is needed
+
+  const Graal::tile_buf& tiles = layers[layer];
+  row_hash_list_type& row_hashes = m_row_hashes[layer];
+  row_hashes.resize(static_cast<std::size_t>(tiles.get_height()), 0);
+
+  const int end_y = std::min(y + height, tiles.get_height());
+  for (y = std::max(0, y); y < end_y; ++y) {
+    boost::uint64_t& row_hash = row_hashes[static_cast<std::size_t>(y)];
+    m_tiles_hash ^= row_hash;
+    row_hash = hash_row(tiles.get_row(y), tiles.get_width(), layer, y);
+    m_tiles_hash ^= row_hash;
+  }
+}
+
+void Graal::level::update_objects_hash() {
+  m_objects_hash = 0;
+  m_object_counts.clear();
+  m_hashed_object_count = 0;
+  m_objects_hash_valid = true;
+
+  for (link_list_type::const_iterator it = links.begin(); it != links.end(); ++it)
+    hash_object(*it);
+  for (sign_list_type::const_iterator it = signs.begin(); it != signs.end(); ++it)
+    hash_object(*it);
+  for (npc_list_type::const_iterator it = npcs.begin(); it != npcs.end(); ++it)
+    hash_object(*it);
+}
+
+void Graal::level::hash_object(const Graal::npc& npc) {
+  if (m_objects_hash_valid)
+    hash_object_key(object_key(npc));
+}
+
+void Graal::level::hash_object(const Graal::link& _link) {
+  if (m_objects_hash_valid)
+    hash_object_key(object_key(_link));
+}
+
+void Graal::level::hash_object(const Graal::sign& _sign) {
+  if (m_objects_hash_valid)
+    hash_object_key(object_key(_sign));
+}
+
+void Graal::level::unhash_object(const Graal::npc& npc) {
+  if (m_objects_hash_valid)
+    unhash_object_key(object_key(npc));
+}
+
+void Graal::level::unhash_object(const Graal::link& _link) {
+  if (m_objects_hash_valid)
+    unhash_object_key(object_key(_link));
+}
+
+void Graal::level::unhash_object(const Graal::sign& _sign) {
+  if (m_objects_hash_valid)
+    unhash_object_key(object_key(_sign));
+}
+
+void Graal::level::hash_object_key(boost::uint64_t key) {
+  int& count = m_object_counts[key];
+  m_objects_hash ^= occurrence_key(key, ++count);
+  ++m_hashed_object_count;
+}
+
+void Graal::level::unhash_object_key(boost::uint64_t key) {
+  object_count_map_type::iterator iter = m_object_counts.find(key);
+  if (iter == m_object_counts.end()) {
+    // The object was changed without unhashing it first, start over
+    m_objects_hash_valid = false;
+    return;
+  }
+
+  m_objects_hash ^= occurrence_key(key, iter->second);
+  if (--iter->second == 0)
+    m_object_counts.erase(iter);
+  --m_hashed_object_count;
+}
+
+Graal::level_snapshot Graal::snapshot_level(const level& _level) {
+  // Layers only copy their row pointers, the rows stay shared
+  return level_snapshot(new level(_level));
+}
+
+Graal::level* Graal::load_nw_level(const boost::filesystem::path& path, tile_row_store* row_store) {
   if (!boost::filesystem::exists(path))
     throw std::runtime_error("load_nw_level("+path.string()+") failed: File not found");
 
@@ -120,107 +531,153 @@ Graal::level* Graal::load_nw_level(const boost::filesystem::path& path) {
   Graal::level* level = new Graal::level();
   while(!file.eof()) {
     std::string type = read<std::string>(file);
+    read_nw_entry(file, type, level, 0, 0, row_store);
+  }
+
+  file.close();
 
-    // read tiles
-    if (type == "BOARD") {
-      int start_x = read<int>(file);
-      int start_y = read<int>(file);
-      int width = read<int>(file);
-      int layer = read<int>(file);
-      std::string data = read<std::string>(file);
+  // Also intern the rows no BOARD entry touched
+  if (row_store) {
+    for (int layer = 0; layer < level->get_layer_count(); ++layer)
+      level->get_tiles(layer).intern_rows(*row_store);
+  }
 
-      // Fill lowest layer with tile 0 by default, otherwise use transparent tile
-      int fill_tile = layer ? tile::transparent_index : 0;
-      Graal::tile_buf& tiles = level->create_tiles(layer, fill_tile);
+  return level;
+  
+}
 
-      for (int i = 0; i < width * 2; i +=2) {
-        int tile_index = static_cast<int>(helper::parse_base64(data.substr(i, 2)));
-        int x = start_x + i/2;
+void Graal::read_nw_entry(std::ifstream& file, const std::string& type, Graal::level* level,
+                          int offset_x, int offset_y, tile_row_store* row_store) {
+  // read tiles
+  if (type == "BOARD") {
+    int start_x = read<int>(file);
+    int start_y = read<int>(file);
+    int width = read<int>(file);
+    int layer = read<int>(file);
+    std::string data = read<std::string>(file);
+
+    // Only decode the part of the row inside the level
+    const int y = start_y - offset_y;
+    const int first = std::max(0, offset_x - start_x);
+    const int last = std::min(std::min(width, static_cast<int>(data.size()) / 2),
+                              offset_x + level->get_width() - start_x);
+    if (y < 0 || y >= level->get_height() || first >= last)
+      return;
+
+    // Fill lowest layer with tile 0 by default, otherwise use transparent tile
+    int fill_tile = layer ? tile::transparent_index : 0;
+    Graal::tile_buf& tiles = level->create_tiles(layer, fill_tile);
+    Graal::tile* row = tiles.get_row(y) + start_x - offset_x;
+
+    for (int i = first; i < last; ++i) {
+      int tile_index = static_cast<int>(helper::parse_base64(data.substr(i * 2, 2)));
+      row[i] = Graal::tile(tile_index);
+    }
 
-        tiles.get_tile(x, start_y) = Graal::tile(tile_index);
-      }
-    // read links
-    } else if (type == "LINK") {
-      Graal::link link;
-      link.destination = read<std::string>(file);
-      link.x = read<int>(file);
-      link.y = read<int>(file);
-      link.width = read<int>(file);
-      link.height = read<int>(file);
-
-      link.new_x = read<std::string>(file);
-      link.new_y = read<std::string>(file);
-
-      level->links.push_back(link);
-    // read signs
-    } else if (type == "SIGN") {
-      Graal::sign sign;
-      sign.x = read<int>(file);
-      sign.y = read<int>(file);
-
-      read_line(file); // finish the current line
-      std::string line;
-      while (true) {
-        line = read_line(file);
-        
-        // Protect against infinite loop in malformed levels
-        if (line == "SIGNEND" || file.eof())
-          break;
-
-        sign.text += line;
-        sign.text += "\n";
-      }
+    if (row_store)
+      tiles.intern_row(y, *row_store);
+  // read links
+  } else if (type == "LINK") {
+    Graal::link link;
+    link.destination = read<std::string>(file);
+    link.x = read<int>(file) - offset_x;
+    link.y = read<int>(file) - offset_y;
+    link.width = read<int>(file);
+    link.height = read<int>(file);
+
+    link.new_x = read<std::string>(file);
+    link.new_y = read<std::string>(file);
+
+    level->add_link(link);
+  // read signs
+  } else if (type == "SIGN") {
+    Graal::sign sign;
+    sign.x = read<int>(file) - offset_x;
+    sign.y = read<int>(file) - offset_y;
+
+    read_line(file); // finish the current line
+    std::string line;
+    while (true) {
+      line = read_line(file);
+      
+      // Protect against infinite loop in malformed levels
+      if (line == "SIGNEND" || file.eof())
+        break;
+
+      sign.text += line;
+      sign.text += "\n";
+    }
 
-      level->signs.push_back(sign);
-    // read npcs
-    } else if (type == "NPC") {
-      Graal::npc& npc = level->add_npc();
-      npc.image = read<std::string>(file);
-      if (npc.image == "-")
-        npc.image.clear();
-      float rx, ry;
-      rx = read<float>(file);
-      ry = read<float>(file);
-      npc.set_level_x(rx);
-      npc.set_level_y(ry);
-
-      read_line(file); // finish the current line
-      std::string line;
-      while (true) {
-        line = read_line(file);
-
-        // Protect against infinite loop in malformed levels
-        if (line == "NPCEND" || file.eof())
-          break;
-
-        npc.script += line;
-        npc.script += "\n";
-      }
-    // else skip the line
-    } else {
-      read_line(file);
+    level->add_sign(sign);
+  // read npcs
+  } else if (type == "NPC") {
+    Graal::npc& npc = level->add_npc();
+    std::string image = read<std::string>(file);
+    if (image == "-")
+      image.clear();
+    npc.image = image_handle(image);
+    float rx, ry;
+    rx = read<float>(file);
+    ry = read<float>(file);
+    npc.set_level_x(rx - offset_x);
+    npc.set_level_y(ry - offset_y);
+
+    read_line(file); // finish the current line
+    std::string line;
+    while (true) {
+      line = read_line(file);
+
+      // Protect against infinite loop in malformed levels
+      if (line == "NPCEND" || file.eof())
+        break;
+
+      npc.script += line;
+      npc.script += "\n";
     }
+  // else skip the line
+  } else {
+    read_line(file);
   }
+}
 
-  file.close();
-  return level;
-  
+namespace {
+  typedef std::list<std::pair<int, std::string> > chunk_list_type;
+
+  /* Write one BOARD entry for each chunk so transparent tile-data is culled */
+  void write_chunks(std::ostream& stream, const chunk_list_type& chunks, int offset_x, int y, int layer) {
+    const std::string s = " ";
+    chunk_list_type::const_iterator iter, end = chunks.end();
+    for (iter = chunks.begin(); iter != end; ++iter) {
+      stream << "BOARD" << s << iter->first + offset_x << s << y << s << iter->second.length() / 2 << s << layer // x, y, width, layer
+             << s << iter->second << std::endl;
+    }
+  }
 }
 
 void Graal::save_nw_level(const Graal::level* level, const boost::filesystem::path& path) {
   std::ofstream stream(path.string().c_str());
 
   stream << NW_LEVEL_VERSION << std::endl;
+  write_nw_entries(stream, level);
+}
 
+void Graal::write_nw_entries(std::ostream& stream, const Graal::level* level, int offset_x, int offset_y) {
   // white space separator
   std::string s = " ";
   // write tiles
   for (int layer = 0; layer < level->get_layer_count(); layer ++) {
     const Graal::tile_buf& tiles = level->get_tiles(layer);
+    // chunk start, chunk data pairs
+    chunk_list_type chunks;
     for (int y = 0; y < tiles.get_height(); y ++) {
+      // Reuse the previous row's chunks if the row is the same
+      if (y > 0 && tiles.row_equal(y, tiles, y - 1)) {
+        write_chunks(stream, chunks, offset_x, y + offset_y, layer);
+        continue;
+      }
+
       std::string data;
-      // chunk start, chunk data pairs
-      std::list<std::pair<int, std::string> > chunks;
+      chunks.clear();
       /* Separate each row into chunks of actually non-transparent tiles.
        * Every time we encounter a transparent tile, flush the current data
        * into the chunk list and clear it. If we never encounter a transparent
@@ -245,12 +702,7 @@ void Graal::save_nw_level(const Graal::level* level, const boost::filesystem::pa
       if (!data.empty())
         chunks.push_back(std::pair<int, std::string>(current_start, data));
 
-      /* Draw one BOARD entry for each chunk so transparent tile-data is culled */
-      std::list<std::pair<int, std::string> >::iterator iter, end = chunks.end();
-      for (iter = chunks.begin(); iter != end; ++iter) {
-        stream << "BOARD" << s << iter->first << s << y << s << iter->second.length() / 2 << s << layer // x, y, width, layer
-               << s << iter->second << std::endl;
-      }
+      write_chunks(stream, chunks, offset_x, y + offset_y, layer);
     }
   }
 
@@ -260,7 +712,7 @@ void Graal::save_nw_level(const Graal::level* level, const boost::filesystem::pa
   for (link_iter = level->links.begin();
        link_iter != link_end;
        link_iter ++) {
-    stream << "LINK" << s << link_iter->destination << s << link_iter->x << s << link_iter->y
+    stream << "LINK" << s << link_iter->destination << s << link_iter->x + offset_x << s << link_iter->y + offset_y
            << s << link_iter->width << s << link_iter->height << s << link_iter->new_x
            << s << link_iter->new_y << std::endl;
   }
@@ -271,7 +723,7 @@ void Graal::save_nw_level(const Graal::level* level, const boost::filesystem::pa
   for (sign_iter = level->signs.begin();
        sign_iter != sign_end;
        sign_iter ++) {
-    stream << "SIGN" << s << sign_iter->x << s << sign_iter->y << std::endl;
+    stream << "SIGN" << s << sign_iter->x + offset_x << s << sign_iter->y + offset_y << std::endl;
     stream << sign_iter->text << std::endl;
     stream << "SIGNEND" << std::endl;
   }
@@ -282,11 +734,13 @@ void Graal::save_nw_level(const Graal::level* level, const boost::filesystem::pa
   for (npc_iter = level->npcs.begin();
        npc_iter != npc_end;
        npc_iter ++) {
-    std::string image = npc_iter->image;
+    std::string image = npc_iter->image.get_name();
     // No image is represented by "-"
     if (image.empty())
       image = "-";
-    stream << "NPC" << s << image << s << npc_iter->get_level_x() << s << npc_iter->get_level_y() << std::endl;
+    stream << "NPC" << s << image
+           << s << npc_iter->get_level_x() + offset_x
+           << s << npc_iter->get_level_y() + offset_y << std::endl;
     stream << npc_iter->script << std::endl;
     stream << "NPCEND" << std::endl;
   }
@@ -2,11 +2,24 @@
 #define GRAAL_LEVEL_HPP_
 
 #include "tileset.hpp"
+#include "object_grid.hpp"
+#include "image_handle.hpp"
+#include <boost/cstdint.hpp>
+#include <boost/move/move.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/pool/pool_alloc.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/filesystem/path.hpp>
+#include <algorithm>
 #include <deque>
+#include <iosfwd>
 #include <list>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace Graal {
   static const char NW_LEVEL_VERSION[] = "GLEVNW01";
@@ -30,46 +43,219 @@ namespace Graal {
   static const tile tile_transparent = tile(tile::transparent_index);
   static const tile tile_invalid = tile(tile::invalid_index);
 
+  typedef std::vector<tile> tile_row;
+  typedef boost::shared_ptr<tile_row> tile_row_ptr;
+
+  /* Hash-consing store for tile rows: rows interned into the same store
+   * are shared if they are equal. The store only keeps weak references, a
+   * row is freed once no tile_buf uses it anymore */
+  class tile_row_store: boost::noncopyable {
+  public:
+    tile_row_store();
+
+    // Returns the stored row equal to row, storing row if there is none
+    tile_row_ptr intern(const tile_row_ptr& row);
+
+    // Number of stored rows, including rows that were freed since the last purge
+    std::size_t size() const { return m_rows.size(); }
+  private:
+    static std::size_t hash_row(const tile_row& row);
+    // Forgets rows that were freed
+    void purge();
+
+    typedef std::multimap<std::size_t, boost::weak_ptr<tile_row> > row_map_type;
+    row_map_type m_rows;
+    std::size_t m_purge_size;
+  };
+
+  /* Keeps the memory of freed tile rows around for new rows. Loading and
+   * evicting levels frees and allocates thousands of rows of the same
+   * size, this spares the allocator most of them */
+  class tile_row_pool: boost::noncopyable {
+  public:
+    // A row of width fill_tiles
+    static tile_row_ptr create(std::size_t width, const tile& fill_tile);
+    // A copy of row
+    static tile_row_ptr copy(const tile_row& row);
+
+    // Frees all recycled rows
+    static void clear();
+  private:
+    struct recycle_row {
+      void operator()(tile_row* row) const;
+    };
+
+    static tile_row_ptr wrap(tile_row* row);
+    static tile_row* take();
+
+    static std::vector<tile_row*> s_free_rows;
+  };
+
+  /* Tiles are stored as rows which are shared between copies of a tile_buf
+   * (and between bufs interned into the same tile_row_store). Rows are only
+   * copied when written to, so read through a const tile_buf whenever
+   * nothing gets changed */
   class tile_buf {
+    BOOST_COPYABLE_AND_MOVABLE(tile_buf)
   public:
-    typedef std::vector<tile> tiles_list_type;
+    typedef std::vector<tile_row_ptr> rows_list_type;
 
     tile_buf() : width(0), height(0) {}
+    tile_buf(const tile_buf& other):
+      rows(other.rows), width(other.width), height(other.height) {}
+    // Takes the rows without touching their reference counts
+    tile_buf(BOOST_RV_REF(tile_buf) other): width(0), height(0) { swap(other); }
+
+    tile_buf& operator=(BOOST_COPY_ASSIGN_REF(tile_buf) other) {
+      rows = other.rows;
+      width = other.width;
+      height = other.height;
+      return *this;
+    }
+
+    tile_buf& operator=(BOOST_RV_REF(tile_buf) other) {
+      clear();
+      swap(other);
+      return *this;
+    }
 
     int get_width() const { return width; }
     int get_height() const { return height; }
 
-          tile& get_tile(int x, int y)       { return tiles[static_cast<size_t>(x + y * width)]; }
-    const tile& get_tile(int x, int y) const { return tiles[static_cast<size_t>(x + y * width)]; }
+          tile& get_tile(int x, int y)       { return get_row(y)[x]; }
+    const tile& get_tile(int x, int y) const { return get_row(y)[x]; }
+
+    // Returns a pointer to the first of width tiles in row y
+    tile* get_row(int y) {
+      tile_row_ptr& row = rows[static_cast<size_t>(y)];
+      if (!row.unique())
+        row = tile_row_pool::copy(*row);
+      return row->empty() ? 0 : &(*row)[0];
+    }
+
+    const tile* get_row(int y) const {
+      const tile_row& row = *rows[static_cast<size_t>(y)];
+      return row.empty() ? 0 : &row[0];
+    }
+
+    /* Compares row y with row other_y of other, shared rows compare equal
+     * without looking at their tiles */
+    bool row_equal(int y, const tile_buf& other, int other_y) const {
+      const tile_row_ptr& row = rows[static_cast<size_t>(y)];
+      const tile_row_ptr& other_row = other.rows[static_cast<size_t>(other_y)];
+      return row == other_row || *row == *other_row;
+    }
+
+    // Replaces row y/all rows with the equal rows from store
+    void intern_row(int y, tile_row_store& store) {
+      tile_row_ptr& row = rows[static_cast<size_t>(y)];
+      row = store.intern(row);
+    }
+
+    void intern_rows(tile_row_store& store) {
+      for (int y = 0; y < height; ++y)
+        intern_row(y, store);
+    }
 
     void swap(tile_buf& other) {
-      tiles.swap(other.tiles);
+      rows.swap(other.rows);
       std::swap(width, other.width);
       std::swap(height, other.height);
     }
 
-    void resize(int w, int h) {
-      tiles.resize(static_cast<size_t>(w * h));
+    // New rows are filled with fill_tile, and share their memory until changed
+    void resize(int w, int h, const tile& fill_tile = tile()) {
+      if (w != width) {
+        for (int y = 0; y < std::min(h, height); ++y) {
+          tile_row_ptr& row = rows[static_cast<size_t>(y)];
+          row = tile_row_pool::copy(*row);
+          row->resize(static_cast<size_t>(w), fill_tile);
+        }
+      }
+
+      rows.resize(static_cast<size_t>(h));
+      if (h > height) {
+        tile_row_ptr fill_row(tile_row_pool::create(static_cast<size_t>(w), fill_tile));
+        std::fill(rows.begin() + height, rows.end(), fill_row);
+      }
+
       width = w;
       height = h;
     }
 
+    // Sets all tiles to fill_tile
+    void fill(const tile& fill_tile) {
+      tile_row_ptr fill_row(tile_row_pool::create(static_cast<size_t>(width), fill_tile));
+      std::fill(rows.begin(), rows.end(), fill_row);
+    }
+
     void clear() {
-      tiles.clear();
+      rows.clear();
       height = width = 0;
     }
 
-    bool empty() {
-      return tiles.empty();
+    bool empty() const {
+      return rows.empty() || width == 0;
     }
+  private:
+    rows_list_type rows;
+    int width;
+    int height;
+  };
+
+  /* Run-length encoded copy of a tile_buf, for keeping tiles around in
+   * less memory while no one looks at them */
+  class compressed_tile_buf {
+  public:
+    compressed_tile_buf(): width(0), height(0) {}
+    explicit compressed_tile_buf(const tile_buf& tiles);
+
+    // Restores the tiles, interning the rows into row_store if passed
+    void decompress(tile_buf& tiles, tile_row_store* row_store = 0) const;
 
-    tiles_list_type tiles;
+    // Memory used by the runs in bytes
+    std::size_t get_size() const { return runs.size() * sizeof(run); }
   private:
+    // Runs go through the rows from top to bottom
+    struct run {
+      boost::uint16_t length;
+      boost::int16_t index;
+    };
+
+    std::vector<run> runs;
     int width;
     int height;
+  };
 
+  namespace detail {
+    template <int N> struct log2 { static const int value = 1 + log2<N / 2>::value; };
+    template <> struct log2<1> { static const int value = 0; };
+  }
+
+  /* Level dimensions known at compile time. Splitting positions into level
+   * and tile positions is done with shifts and masks, so both dimensions
+   * have to be powers of two */
+  template <int Width, int Height>
+  struct fixed_level_size {
+    BOOST_STATIC_ASSERT(Width > 0 && (Width & (Width - 1)) == 0);
+    BOOST_STATIC_ASSERT(Height > 0 && (Height & (Height - 1)) == 0);
+
+    static const int width = Width;
+    static const int height = Height;
+    static const int width_shift = detail::log2<Width>::value;
+    static const int height_shift = detail::log2<Height>::value;
+
+    // The level containing a GLOBAL tile position
+    static int to_level_x(int x) { return x >> width_shift; }
+    static int to_level_y(int y) { return y >> height_shift; }
+    // The position inside that level
+    static int to_tile_x(int x) { return x & (Width - 1); }
+    static int to_tile_y(int y) { return y & (Height - 1); }
   };
 
+  // The size of every Graal level
+  typedef fixed_level_size<64, 64> default_level_size;
+
   class link {
   public:
     int x, y;
@@ -89,8 +275,38 @@ namespace Graal {
   };
 
   class npc {
+    BOOST_COPYABLE_AND_MOVABLE(npc)
   public:
-    std::string image;
+    npc(): id(0), x(0), y(0) {}
+    npc(const npc& other):
+      image(other.image), script(other.script), id(other.id), x(other.x), y(other.y) {}
+    // Moving takes the script instead of copying it, scripts can be long
+    npc(BOOST_RV_REF(npc) other):
+      image(other.image), id(other.id), x(other.x), y(other.y) {
+      script.swap(other.script);
+    }
+
+    npc& operator=(BOOST_COPY_ASSIGN_REF(npc) other) {
+      image = other.image;
+      script = other.script;
+      id = other.id;
+      x = other.x;
+      y = other.y;
+      return *this;
+    }
+
+    npc& operator=(BOOST_RV_REF(npc) other) {
+      image = other.image;
+      script.swap(other.script);
+      other.script.clear();
+      id = other.id;
+      x = other.x;
+      y = other.y;
+      return *this;
+    }
+
+    // Resolved once when set, see image_handle
+    image_handle image;
     std::string script;
     int id;
 
@@ -127,18 +343,55 @@ namespace Graal {
   class level {
   public:
     level(int fill_tile = 0);
-    typedef std::list<link> link_list_type;
-    typedef std::list<sign> sign_list_type;
-    typedef std::list<npc> npc_list_type;
+    // List nodes come from shared pools, levels get loaded and freed a lot
+    typedef std::list<link, boost::fast_pool_allocator<link> > link_list_type;
+    typedef std::list<sign, boost::fast_pool_allocator<sign> > sign_list_type;
+    typedef std::list<npc, boost::fast_pool_allocator<npc> > npc_list_type;
     typedef std::vector<tile_buf> layers_list_type;
+    typedef object_grid<link_list_type>::result_type link_query_type;
+    typedef object_grid<sign_list_type>::result_type sign_query_type;
 
-    int get_width() const;
-    int get_height() const;
+    // Inline so loops over a level's tiles get constant bounds
+    int get_width() const { return default_level_size::width; }
+    int get_height() const { return default_level_size::height; }
 
+    /* NPCs, links and signs should be added, removed and changed through
+     * these so the content hash and the spatial index stay in sync */
     Graal::npc& add_npc();
-    Graal::npc& add_npc(Graal::npc npc);
+    Graal::npc& add_npc(const Graal::npc& npc);
+    Graal::npc& add_npc(BOOST_RV_REF(Graal::npc) npc);
     level::npc_list_type::iterator get_npc(int id);
     void delete_npc(int id);
+    // Moves the NPC out of the level into result
+    void take_npc(int id, Graal::npc& result);
+    // Replaces the NPC with npc, keeping its id
+    void update_npc(npc_list_type::iterator iter, const Graal::npc& npc);
+
+    link_list_type::iterator add_link(const Graal::link& _link);
+    void delete_link(link_list_type::iterator iter);
+    void update_link(link_list_type::iterator iter, const Graal::link& _link);
+
+    sign_list_type::iterator add_sign(const Graal::sign& _sign);
+    void delete_sign(sign_list_type::iterator iter);
+    void update_sign(sign_list_type::iterator iter, const Graal::sign& _sign);
+
+    /* To change an object in place instead, take it out of the hash before
+     * and put it back afterwards:
+     *
+     *   level.unhash_object(npc);
+     *   npc.set_level_x(x);
+     *   level.hash_object(npc);
+     */
+    void hash_object(const Graal::npc& npc);
+    void hash_object(const Graal::link& _link);
+    void hash_object(const Graal::sign& _sign);
+    void unhash_object(const Graal::npc& npc);
+    void unhash_object(const Graal::link& _link);
+    void unhash_object(const Graal::sign& _sign);
+
+    // Append all links/signs intersecting the given tile rectangle to result
+    void find_links(int x, int y, int width, int height, link_query_type& result);
+    void find_signs(int x, int y, int width, int height, sign_query_type& result);
 
     tile_buf& create_tiles(int layer = 0, int fill_tile = tile::transparent_index, bool overwrite = false);
     tile_buf& get_tiles(int layer = 0);
@@ -150,17 +403,77 @@ namespace Graal {
 
     int get_layer_count() const;
 
+    /* Zobrist style hash of the tiles and objects: pseudo random keys per
+     * (layer, x, y, tile) and per object XORed together, so a change only
+     * has to XOR out the keys of what it touched and XOR in the new ones.
+     * Transparent tiles have no key, adding or removing empty layers keeps
+     * the hash.
+     *
+     * Objects are updated by the functions above. Tiles are written through
+     * raw row pointers (tile_region, get_tile_editable), so the old tiles
+     * aren't known anymore when the change is reported. Instead the keys of
+     * each row are kept XORed together, and a change replaces the keys of
+     * the changed rows. Call update_tiles_hash after changing tiles,
+     * level_map does this for the changes it reports */
+    boost::uint64_t get_content_hash();
+    // Rehashes rows y to y + height of layer
+    void update_tiles_hash(int layer, int y, int height);
+    // Rehashes all objects, for when the object lists were changed directly
+    void update_objects_hash();
+
     layers_list_type layers;
     link_list_type links;
     sign_list_type signs;
     npc_list_type npcs;
   protected:
+    void index_link(link_list_type::iterator iter);
+    void index_sign(sign_list_type::iterator iter);
+    // Rebuilds the spatial indices if the lists were changed directly
+    void update_object_index();
+
     int m_unique_npc_id_counter;
     int m_fill_tile;
+
+    typedef std::vector<boost::uint64_t> row_hash_list_type;
+    // Hash of each row, per layer, empty until first needed
+    std::vector<row_hash_list_type> m_row_hashes;
+    boost::uint64_t m_tiles_hash;
+    boost::uint64_t m_objects_hash;
+    // Objects are hashed once the hash is first needed
+    bool m_objects_hash_valid;
+
+    /* Number of objects per object key. Equal objects would cancel each
+     * other out, so the n-th one gets a key of its own */
+    typedef boost::unordered_map<boost::uint64_t, int> object_count_map_type;
+    object_count_map_type m_object_counts;
+    std::size_t m_hashed_object_count;
+
+    void hash_object_key(boost::uint64_t key);
+    void unhash_object_key(boost::uint64_t key);
+
+    object_grid<link_list_type> m_link_grid;
+    object_grid<sign_list_type> m_sign_grid;
   };
 
-  level* load_nw_level(const boost::filesystem::path& path);
+  /* An immutable copy of a level. Its layers share their tile rows with
+   * the level until the level changes them, so taking one only copies row
+   * pointers and the object lists. A snapshot can be read from another
+   * thread without locking while the level keeps being edited */
+  typedef boost::shared_ptr<const level> level_snapshot;
+  level_snapshot snapshot_level(const level& _level);
+
+  /* Loads a level, interning its tile rows into row_store if one is
+   * passed */
+  level* load_nw_level(const boost::filesystem::path& path, tile_row_store* row_store = 0);
   void save_nw_level(const level* _level, const boost::filesystem::path& path);
+
+  /* Reads the rest of a level file entry of the passed type (BOARD, LINK,
+   * ...) into _level, moved by -offset_x, -offset_y. Tiles outside of the
+   * level are skipped, unknown entries are skipped entirely */
+  void read_nw_entry(std::ifstream& file, const std::string& type, level* _level,
+                     int offset_x = 0, int offset_y = 0, tile_row_store* row_store = 0);
+  // Writes all entries of _level, moved by offset_x, offset_y
+  void write_nw_entries(std::ostream& stream, const level* _level, int offset_x = 0, int offset_y = 0);
 }
 
 #endif
@@ -8,6 +8,7 @@
 #include <queue>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 
 using namespace Graal;
 using namespace Graal::level_editor;
@@ -32,14 +33,19 @@ level_display::level_display(
       m_default_tile_index(default_tile_index),
       m_image_cache(cache),
       m_texture_cache(cache),
-      m_use_vbo(false) {
+      m_use_vbo(false),
+      m_use_tilemap_shader(false),
+      m_use_level_textures(false),
+      m_framebuffer(0),
+      m_thumbnail_tileset_generation(0) {
   add_events(Gdk::BUTTON_PRESS_MASK
              | Gdk::BUTTON_RELEASE_MASK
              | Gdk::BUTTON_MOTION_MASK
              | Gdk::POINTER_MOTION_MASK
              | Gdk::KEY_PRESS_MASK
              | Gdk::KEY_RELEASE_MASK
-             | Gdk::LEAVE_NOTIFY_MASK);
+             | Gdk::LEAVE_NOTIFY_MASK
+             | Gdk::SCROLL_MASK);
 
   signal_button_press_event().connect_notify(
     sigc::mem_fun(this, &level_display::on_button_pressed));
@@ -52,6 +58,9 @@ level_display::level_display(
   signal_leave_notify_event().connect_notify(
     sigc::mem_fun(this, &level_display::on_mouse_leave));
 
+  signal_scroll_event().connect(
+    sigc::mem_fun(this, &level_display::on_scroll), false);
+
   /*m_image_cache.signal_cache_update().connect(
     sigc::mem_fun(this, &level_display::update_all));*/
 
@@ -67,9 +76,9 @@ level_display::level_display(
   m_active_layer = 0;
   
   m_position_buffer = 0;
-  m_texcoord_buffer = 0;
 
   m_unsaved = false;
+  m_current_level_changed = true;
 }
 
 void level_display::set_default_tile(int tile_index) {
@@ -85,7 +94,8 @@ void level_display::set_active_layer(int layer) {
 }
 
 void level_display::load_level(const boost::filesystem::path& file_path) {
-  set_level_map(new single_level_map_source(file_path));
+  // Levels larger than the default size get split into chunks
+  set_level_map(new chunked_level_map_source(file_path));
 }
 
 void level_display::load_gmap(filesystem& fs, const boost::filesystem::path& file_path) {
@@ -96,18 +106,31 @@ void level_display::load_gmap(filesystem& fs, const boost::filesystem::path& fil
 void level_display::set_level_map(level_map_source* level_source) {
   m_level_source.reset(level_source);
   m_level_map.reset(new level_map());
+  m_level_map->set_intern_rows(m_preferences.intern_tile_rows);
+  m_level_map->set_level_registry(m_level_registry);
   m_level_map->set_level_source(m_level_source);
+  m_level_map->set_max_loaded_levels(m_preferences.max_loaded_levels);
 
-  m_level_map->signal_level_changed().connect(
+  m_level_map->signal_dirty_rects().connect(
     sigc::mem_fun(*this, &level_display::on_level_changed));
+  level_cache_list_type::iterator cache_iter, cache_end = m_level_caches.end();
+  for (cache_iter = m_level_caches.begin(); cache_iter != cache_end; ++cache_iter)
+    release_level_cache(cache_iter->second);
+  m_level_caches.clear();
+  release_thumbnails();
 
   // TODO: ???
   m_current_level_x = 0;
   m_current_level_y = 0;
+  m_current_level_changed = true;
 
   clear_selection();
 }
 
+void level_display::set_level_registry(const boost::shared_ptr<level_registry>& registry) {
+  m_level_registry = registry;
+}
+
 void level_display::new_level(int fill_tile = 0) {
   level* new_level = new Graal::level(fill_tile);
   // The level name needs to be set by the host
@@ -116,16 +139,66 @@ void level_display::new_level(int fill_tile = 0) {
 }
 
 void level_display::save_current_level() {
-  m_level_map->get_level_source()->save_level(m_current_level_x, m_current_level_y, get_current_level().get());
+  save_levels(false);
+}
+
+void level_display::save_levels(bool force) {
+  const boost::shared_ptr<level_map_source>& source = m_level_map->get_level_source();
+  // Keeps the levels loaded while they are written
+  std::vector<boost::shared_ptr<level> > saved_levels;
+  level_map_source::saved_level_list_type levels;
+
+  // Nothing to write if the level still matches the file
+  if (force || m_level_map->is_level_changed(m_current_level_x, m_current_level_y)) {
+    saved_levels.push_back(get_current_level());
+    levels.push_back(level_map_source::saved_level(
+      m_current_level_x, m_current_level_y, saved_levels.back().get()));
+  }
   set_unsaved(m_current_level_x, m_current_level_y, false);
+
+  // All chunks of a single level file get saved together
+  if (source->is_single_file()) {
+    unsaved_level_map_type::iterator iter, end = m_unsaved_levels.end();
+    for (iter = m_unsaved_levels.begin(); iter != end; ++iter) {
+      if (!iter->second)
+        continue;
+      const int level_x = iter->first.first, level_y = iter->first.second;
+      boost::shared_ptr<level> unsaved_level = m_level_map->get_level(level_x, level_y);
+      if (unsaved_level) {
+        saved_levels.push_back(unsaved_level);
+        levels.push_back(level_map_source::saved_level(level_x, level_y, unsaved_level.get()));
+      }
+      iter->second = false;
+    }
+  }
+
+  // Sources backed by one file write it only once
+  source->save_levels(levels);
+
+  level_map_source::saved_level_list_type::const_iterator iter, end = levels.end();
+  for (iter = levels.begin(); iter != end; ++iter)
+    m_level_map->mark_level_saved(iter->x, iter->y);
 }
 
 void level_display::save_current_level(
     const boost::filesystem::path& path) {
-  m_level_map->get_level_source()->set_level_name(
-    m_current_level_x, m_current_level_y,
-    path.string());
-  save_current_level();
+  const boost::shared_ptr<level_map_source>& source = m_level_map->get_level_source();
+  if (source->is_single_file()) {
+    // Save the whole file under the new name, starting with the current chunk
+    for (int x = 0; x < source->get_width(); ++x) {
+      for (int y = 0; y < source->get_height(); ++y)
+        source->set_level_name(x, y, path.string());
+    }
+  } else {
+    source->set_level_name(
+      m_current_level_x, m_current_level_y,
+      path.string());
+  }
+  // The new file doesn't have the level yet
+  save_levels(true);
+
+  m_current_level_changed = true;
+  invalidate();
 }
 
 void level_display::save_selection() {
@@ -150,25 +223,35 @@ void level_display::save_selection() {
   if (actual_width < 0 || actual_height < 0)
     return;
 
+  // Signal the tile changes and the undo diff together
+  level_map::edit_scope scope(*m_level_map);
+
   tile_buf buf; // make a bounds-checked copy of the selection while applying
   buf.resize(actual_width, actual_height);
 
-  for (int x = offset_left; x < selection.get_width() - offset_right; ++x) {
-    for (int y = offset_top; y < selection.get_height() - offset_bottom; ++y) {
-      const int tx = x + sx;
-      const int ty = y + sy;
-
-      const tile& t = m_level_map->get_tile(tx, ty, m_active_layer);
-      buf.get_tile(x - offset_left, y - offset_top) = t;
-      m_level_map->set_tile(selection.get_tile(x, y), tx, ty, m_active_layer);
+  {
+    level_map::tile_region region(*m_level_map,
+      sx + offset_left, sy + offset_top, actual_width, actual_height,
+      m_active_layer, true);
+    while (region.next()) {
+      const int x = region.get_region_x();
+      const int y = region.get_region_y();
+      const int width = region.get_span_width();
+
+      tile* tiles = region.get_tiles();
+      const tile* selection_tiles = selection.get_row(y + offset_top) + x + offset_left;
+      std::copy(tiles, tiles + width, buf.get_row(y) + x);
+      std::copy(selection_tiles, selection_tiles + width, tiles);
     }
   }
 
   // destroy buf
-  add_undo_diff(new tile_diff(sx + offset_left, sy + offset_top, buf, m_active_layer));
+  add_undo_diff(new tile_diff(sx + offset_left, sy + offset_top, boost::move(buf), m_active_layer));
 }
 
 void level_display::delete_selection() {
+  level_map::edit_scope scope(*m_level_map);
+
   if (npc_selected()) {
     add_undo_diff(new delete_npc_diff(selected_npc, *m_level_map->get_npc(selected_npc)));
     m_level_map->delete_npc(selected_npc);
@@ -261,6 +344,11 @@ void level_display::on_button_motion(GdkEventMotion*) {
   const int tx = helper::bound_by(tile_x, 0, m_level_map->get_width_tiles() - 1);
   const int ty = helper::bound_by(tile_y, 0, m_level_map->get_height_tiles() - 1);
 
+  // Only redraw if the selection actually moved or changed size
+  const int old_select_x = m_select_x, old_select_y = m_select_y;
+  const int old_select_width = m_select_width, old_select_height = m_select_height;
+  const bool was_dragging = m_dragging;
+
   if (m_dragging) {
     // Move selection
     const int delta_x = (to_tiles_x(x - m_drag_mouse_x) - to_tiles_x(m_select_x)) * m_tile_width;
@@ -284,8 +372,6 @@ void level_display::on_button_motion(GdkEventMotion*) {
       m_select_x = new_select_x;
       m_select_y = new_select_y;
     }
-
-    invalidate();
   } else if (m_selecting) {
     // extend selection rectangle or
     // if you move the mouse when you have a npc selected, switch to dragging
@@ -310,14 +396,18 @@ void level_display::on_button_motion(GdkEventMotion*) {
       m_drag_start_x = tx * m_tile_width;
       m_drag_start_y = ty * m_tile_height;
     }
-    
-    invalidate();
   }
 
+  if (m_select_x != old_select_x || m_select_y != old_select_y ||
+      m_select_width != old_select_width || m_select_height != old_select_height ||
+      m_dragging != was_dragging)
+    invalidate();
+
   std::ostringstream str;
   str
     << "Tile (" << tx << ", " << ty << "): "
     << m_level_map->get_tile(tx, ty, m_active_layer).index;
+  describe_objects_at(str, tx, ty);
   m_signal_status_update(str.str());
 
   // change cursor
@@ -329,6 +419,35 @@ void level_display::on_button_motion(GdkEventMotion*) {
   }
 }
 
+void level_display::describe_objects_at(std::ostream& str, int tile_x, int tile_y) {
+  const int level_width = m_level_map->get_level_width();
+  const int level_height = m_level_map->get_level_height();
+
+  level* hover_level = m_level_map->get_level(tile_x / level_width, tile_y / level_height).get();
+  if (!hover_level)
+    return;
+
+  const int level_tile_x = tile_x % level_width;
+  const int level_tile_y = tile_y % level_height;
+
+  if (!m_preferences.hide_links) {
+    level::link_query_type links;
+    hover_level->find_links(level_tile_x, level_tile_y, 1, 1, links);
+    level::link_query_type::iterator iter, end = links.end();
+    for (iter = links.begin(); iter != end; ++iter) {
+      str << " | Link to " << (*iter)->destination
+          << " (" << (*iter)->new_x << ", " << (*iter)->new_y << ")";
+    }
+  }
+
+  if (!m_preferences.hide_signs) {
+    level::sign_query_type signs;
+    hover_level->find_signs(level_tile_x, level_tile_y, 1, 1, signs);
+    if (!signs.empty())
+      str << " | Sign";
+  }
+}
+
 void level_display::on_button_pressed(GdkEventButton* event) {
   grab_focus();
 
@@ -350,8 +469,8 @@ void level_display::on_button_pressed(GdkEventButton* event) {
           Graal::npc new_npc = dialog.get_npc();
           if (new_npc != *npc) {
             add_undo_diff(new npc_diff(selected_npc, *npc));
+            m_level_map->update_npc(selected_npc, new_npc);
           }
-          (*npc) = new_npc;
         }
         m_dragging = false;
         m_selecting = false;
@@ -596,30 +715,35 @@ void level_display::lift_selection() {
   if (actual_width < 0 || actual_height < 0)
     return;
 
+  level_map::edit_scope scope(*m_level_map);
+
   selection.clear();
   selection.resize(sw, sh);
   tile_buf buf;
   buf.resize(actual_width, actual_height);
 
-  for (int x = offset_left; x < selection.get_width() - offset_right; ++x) {
-    for (int y = offset_top; y < selection.get_height() - offset_bottom; ++y) {
-      const int tx = x + sx;
-      const int ty = y + sy;
-
-      tile t = m_level_map->get_tile(tx, ty, m_active_layer);
-      selection.get_tile(x, y)
-        = buf.get_tile(x - offset_left, y - offset_top)
-        = t;
-
-      /* Set tiles below the selection to the default tile on layer 0, and to
-       * the transparent tile on layers > 0 */
-      t.index = m_active_layer > 0 ? tile::transparent_index : m_default_tile_index;
-      m_level_map->set_tile(t, tx, ty, m_active_layer);
+  /* Set tiles below the selection to the default tile on layer 0, and to
+   * the transparent tile on layers > 0 */
+  const tile fill_tile(m_active_layer > 0 ? tile::transparent_index : m_default_tile_index);
+
+  {
+    level_map::tile_region region(*m_level_map,
+      sx + offset_left, sy + offset_top, actual_width, actual_height,
+      m_active_layer, true);
+    while (region.next()) {
+      const int x = region.get_region_x();
+      const int y = region.get_region_y();
+      const int width = region.get_span_width();
+
+      tile* tiles = region.get_tiles();
+      std::copy(tiles, tiles + width, selection.get_row(y + offset_top) + x + offset_left);
+      std::copy(tiles, tiles + width, buf.get_row(y) + x);
+      std::fill(tiles, tiles + width, fill_tile);
     }
   }
 
   // destroy buf
-  add_undo_diff(new tile_diff(sx + offset_left, sy + offset_right, buf, m_active_layer));
+  add_undo_diff(new tile_diff(sx + offset_left, sy + offset_top, boost::move(buf), m_active_layer));
   invalidate();
 }
 
@@ -634,7 +758,7 @@ void level_display::grab_selection() {
 }
 
 // tiles
-void level_display::drag_selection(tile_buf& tiles,
+void level_display::drag_selection(BOOST_RV_REF(tile_buf) tiles,
                                        int drag_x, int drag_y) {
   int x, y;
   get_cursor_position(x, y);
@@ -647,7 +771,7 @@ void level_display::drag_selection(tile_buf& tiles,
     clear_selection();
   //}
 
-  selection.swap(tiles);
+  selection = boost::move(tiles);
 
   const int tw = m_tile_width;
   const int th = m_tile_height;
@@ -714,6 +838,8 @@ void level_display::drag_selection(const npc& _npc) {
 }
 
 void level_display::undo() {
+  level_map::edit_scope scope(*m_level_map);
+
   if (has_selection()) {
     save_selection();
   }
@@ -722,24 +848,30 @@ void level_display::undo() {
     return;
 
   redo_buffer.push(undo_buffer.apply(*m_level_map));
-  m_level_map->signal_level_changed()(m_current_level_x, m_current_level_y);
+  m_level_map->mark_level_changed(m_current_level_x, m_current_level_y);
   invalidate();
 }
 
 void level_display::redo() {
+  level_map::edit_scope scope(*m_level_map);
+
   if (redo_buffer.empty())
     return;
 
   undo_buffer.push(redo_buffer.apply(*m_level_map));
-  m_level_map->signal_level_changed()(m_current_level_x, m_current_level_y);
+  m_level_map->mark_level_changed(m_current_level_x, m_current_level_y);
   invalidate();
 }
 
+void level_display::mark_current_level_changed() {
+  m_level_map->mark_level_changed(m_current_level_x, m_current_level_y);
+}
+
 void level_display::add_undo_diff(basic_diff* diff) {
   undo_buffer.push(diff);
   redo_buffer.clear();
 
-  m_level_map->signal_level_changed()(m_current_level_x, m_current_level_y);
+  m_level_map->mark_level_changed(m_current_level_x, m_current_level_y);
 }
 
 level_display::signal_default_tile_changed_type&
@@ -777,12 +909,18 @@ void level_display::flood_fill(int tx, int ty, int fill_with_index) {
   static int vec_x[] = {-1, 0, 1, 0};
   static int vec_y[] = { 0, -1, 0, 1};
 
+  level_map::edit_scope scope(*m_level_map);
+  level_map::tile_accessor tiles(*m_level_map, m_active_layer);
+  const tile* start_tile = tiles.get_tile(tx, ty);
+  if (!start_tile)
+    return;
+
   // the index of the tiles to fill
-  int fill_index = m_level_map->get_tile(tx, ty, m_active_layer).index;
+  int fill_index = start_tile->index;
   // Abort if the start tile's index is the same as the fill tile
   if (fill_with_index == fill_index)
     return;
-  m_level_map->set_tile(tile(fill_with_index), tx, ty, m_active_layer);
+  tiles.set_tile(tile(fill_with_index), tx, ty);
 
 
   std::queue<std::pair<int, int> > queue;
@@ -813,13 +951,10 @@ void level_display::flood_fill(int tx, int ty, int fill_with_index) {
       int current_tx = cx + vec_x[i];
       int current_ty = cy + vec_y[i];
 
-      if (current_tx >= 0 && current_tx < m_level_map->get_width_tiles() &&
-          current_ty >= 0 && current_ty < m_level_map->get_height_tiles()) {
-        int adjacent_tile_index = m_level_map->get_tile(current_tx, current_ty, m_active_layer).index;
-        if (adjacent_tile_index == fill_index) {
-          queue.push(std::pair<int, int>(current_tx, current_ty));
-          m_level_map->set_tile(tile(fill_with_index), current_tx, current_ty, m_active_layer);
-        }
+      const tile* adjacent_tile = tiles.get_tile(current_tx, current_ty);
+      if (adjacent_tile && adjacent_tile->index == fill_index) {
+        queue.push(std::pair<int, int>(current_tx, current_ty));
+        tiles.set_tile(tile(fill_with_index), current_tx, current_ty);
       }
     }
   }
@@ -832,12 +967,13 @@ void level_display::flood_fill(int tx, int ty, int fill_with_index) {
   buffer.resize(width, height);
 
   // copy old level part
-  for (int x = 0; x < width; ++x) {
-    for (int y = 0; y < height; ++y) {
-      const int cx = start_x + x;
-      const int cy = start_y + y;
-      tile& current_tile = buffer.get_tile(x, y);
-      current_tile = m_level_map->get_tile(cx, cy, m_active_layer);
+  {
+    level_map::tile_region region(*m_level_map,
+      start_x, start_y, width, height, m_active_layer);
+    while (region.next()) {
+      const tile* level_tiles = region.read_tiles();
+      std::copy(level_tiles, level_tiles + region.get_span_width(),
+        buffer.get_row(region.get_region_y()) + region.get_region_x());
     }
   }
 
@@ -849,7 +985,7 @@ void level_display::flood_fill(int tx, int ty, int fill_with_index) {
 
     buffer.get_tile(cx, cy).index = fill_index;
   }
-  add_undo_diff(new tile_diff(start_x, start_y, buffer, m_active_layer));
+  add_undo_diff(new tile_diff(start_x, start_y, boost::move(buffer), m_active_layer));
   
   invalidate();
 }
@@ -872,44 +1008,442 @@ bool level_display::get_layer_visibility(std::size_t layer) {
 }
 
 void level_display::draw_rectangle(float x, float y, float width, float height, float r, float g, float b, float a, bool fill) {
-  glDisable(GL_TEXTURE_2D);
+  m_overlays.add_rectangle(x, y, width, height, r, g, b, a, fill);
+}
+
+level_display::level_cache& level_display::get_level_cache(level* current_level, int level_x, int level_y) {
+  level_cache& cache = m_level_caches[std::make_pair(level_x, level_y)];
+  const int layer_count = current_level->get_layer_count();
+  const int height = current_level->get_height();
+
+  if (cache.level_ptr != current_level ||
+      cache.tileset_generation != m_tileset_generation ||
+      cache.active_layer != m_active_layer ||
+      cache.fade_layers != m_preferences.fade_layers ||
+      cache.layer_count != layer_count ||
+      cache.layer_visibility != m_layer_visibility) {
+    cache.level_ptr = current_level;
+    cache.tileset_generation = m_tileset_generation;
+    cache.active_layer = m_active_layer;
+    cache.fade_layers = m_preferences.fade_layers;
+    cache.layer_count = layer_count;
+    cache.layer_visibility = m_layer_visibility;
+
+    cache.dirty_begin = 0;
+    cache.dirty_end = height;
+
+    // Every group gets other layers or looks different now
+    for (int i = 0; i < level_cache::group_count; ++i) {
+      cache.groups[i].dirty_begin = 0;
+      cache.groups[i].dirty_end = height;
+    }
+  }
 
-  if (fill) {
-    glColor4f(r, g, b, a);
+  if (cache.dirty_begin < cache.dirty_end) {
+    update_level_cache(cache, current_level,
+      std::max(0, cache.dirty_begin), std::min(height, cache.dirty_end));
+    cache.dirty_begin = cache.dirty_end = 0;
+  }
+
+  return cache;
+}
+
+void level_display::update_level_cache(level_cache& cache, level* current_level, int start_y, int end_y) {
+  const int width = current_level->get_width();
+  const int height = current_level->get_height();
+  const int layer_count = current_level->get_layer_count();
+  const std::size_t size = static_cast<std::size_t>(width * height);
+
+  // Walk down from the top, the first opaque tile found is the topmost one
+  cache.top_layer.resize(size, -1);
+  std::fill(cache.top_layer.begin() + start_y * width, cache.top_layer.begin() + end_y * width, -1);
+  for (int i = layer_count - 1; i > 0; --i) {
+    if (!get_layer_visibility(i))
+      continue;
+    // Faded layers are drawn translucent and don't hide anything
+    if (m_preferences.fade_layers && i > m_active_layer)
+      continue;
+
+    const tile_buf& tiles = current_level->get_tiles(i);
+    for (int y = start_y; y < end_y; ++y) {
+      const tile* row = tiles.get_row(y);
+      short* top_layer = &cache.top_layer[static_cast<std::size_t>(y * width)];
+      for (int x = 0; x < width; ++x) {
+        if (top_layer[x] < 0 && get_tile_opacity(row[x]) == tile_opaque)
+          top_layer[x] = static_cast<short>(i);
+      }
+    }
+  }
+
+  // Dropped layers take their buffers with them
+  for (std::size_t i = static_cast<std::size_t>(layer_count); i < cache.layers.size(); ++i) {
+    if (cache.layers[i].buffer)
+      m_unused_buffers.push_back(cache.layers[i].buffer);
+    if (cache.layers[i].tile_texture)
+      m_unused_textures.push_back(cache.layers[i].tile_texture);
+  }
+  cache.layers.resize(static_cast<std::size_t>(layer_count));
+
+  // Only the changed rows get uploaded, which are contiguous
+  std::vector<vertex_texcoord> row_tcoords;
+  std::vector<ogl_tilemap_shader::texel> row_texels;
+  for (int i = 0; i < layer_count; ++i) {
+    layer_cache& layer = cache.layers[static_cast<std::size_t>(i)];
+    layer.row_chunks.resize(static_cast<std::size_t>(height));
+
+    // Each tile needs 4 texcoords, or a texel with the shader
+    std::vector<vertex_texcoord>* tcoords = &layer.tcoords;
+    int first_index = 0;
+    if (m_use_tilemap_shader) {
+      row_texels.assign(static_cast<std::size_t>((end_y - start_y) * width), ogl_tilemap_shader::texel());
+    } else if (m_use_vbo) {
+      row_tcoords.assign(static_cast<std::size_t>((end_y - start_y) * width * 4), vertex_texcoord(0, 0));
+      tcoords = &row_tcoords;
+      first_index = start_y * width * 4;
+    } else {
+      layer.tcoords.resize(size * 4);
+    }
+
+    const tile_buf& tiles = current_level->get_tiles(i);
+    for (int y = start_y; y < end_y; ++y) {
+      const tile* row = tiles.get_row(y);
+      const short* top_layer = &cache.top_layer[static_cast<std::size_t>(y * width)];
+      /* We need to draw this in chunks so we can skip transparent tiles */
+      std::vector<std::pair<int, int> >& chunks = layer.row_chunks[static_cast<std::size_t>(y)];
+      chunks.clear();
+
+      for (int x = 0; x < width; ++x) {
+        const tile& _tile = row[x];
+        // Skip transparent and hidden tiles
+        if (_tile == Graal::tile_transparent ||
+            top_layer[x] > i ||
+            get_tile_opacity(_tile) == tile_empty)
+          continue;
+
+        if (m_use_tilemap_shader) {
+          // The position of the actual tile inside the tileset
+          const int tx = helper::get_tile_x(_tile.index);
+          const int ty = helper::get_tile_y(_tile.index);
+          if (tx < 0 || ty < 0 || tx > 255 || ty > 255)
+            continue;
+
+          ogl_tilemap_shader::texel& texel = row_texels[static_cast<std::size_t>((y - start_y) * width + x)];
+          texel.column = static_cast<unsigned char>(tx);
+          texel.row = static_cast<unsigned char>(ty);
+          texel.drawn = 255;
+          continue;
+        }
+
+        const tile_uv uv = get_tile_uv(_tile.index);
+
+        // Fill texcoord array at the current vertex position
+        int index = (y * width + x) * 4 - first_index;
+
+        (*tcoords)[index++] = vertex_texcoord(uv.x1, uv.y1);
+        (*tcoords)[index++] = vertex_texcoord(uv.x2, uv.y1);
+        (*tcoords)[index++] = vertex_texcoord(uv.x2, uv.y2);
+        (*tcoords)[index  ] = vertex_texcoord(uv.x1, uv.y2);
+
+        const int tile_index = y * width + x;
+        if (!chunks.empty() && chunks.back().first + chunks.back().second == tile_index)
+          ++chunks.back().second;
+        else
+          chunks.push_back(std::pair<int, int>(tile_index, 1));
+      }
+    }
+
+    if (m_use_tilemap_shader) {
+      if (!layer.tile_texture)
+        layer.tile_texture = ogl_tilemap_shader::create_tile_texture(width, height);
+      ogl_tilemap_shader::update_tile_texture(layer.tile_texture,
+        start_y, width, end_y - start_y, &row_texels.front());
+    } else if (m_use_vbo) {
+      if (!layer.buffer) {
+        glGenBuffers(1, &layer.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, layer.buffer);
+        glBufferData(GL_ARRAY_BUFFER, size * 4 * sizeof(vertex_texcoord), 0, GL_DYNAMIC_DRAW);
+      } else {
+        glBindBuffer(GL_ARRAY_BUFFER, layer.buffer);
+      }
+      glBufferSubData(GL_ARRAY_BUFFER,
+                      first_index * sizeof(vertex_texcoord),
+                      row_tcoords.size() * sizeof(vertex_texcoord),
+                      &row_tcoords.front());
+    }
+  }
+}
+
+namespace {
+  // Extends the row range begin..end to include y..y + height
+  void add_dirty_rows(int& begin, int& end, int y, int height) {
+    if (begin < end) {
+      begin = std::min(begin, y);
+      end = std::max(end, y + height);
+    } else {
+      begin = y;
+      end = y + height;
+    }
+  }
+}
+
+void level_display::invalidate_level_cache(int level_x, int level_y, int layer, int y, int height) {
+  level_cache_list_type::iterator iter = m_level_caches.find(std::make_pair(level_x, level_y));
+  if (iter == m_level_caches.end())
+    return;
+
+  level_cache& cache = iter->second;
+  add_dirty_rows(cache.dirty_begin, cache.dirty_end, y, height);
+
+  // Tiles only hide tiles below them, so groups above the layer stay valid
+  for (int i = 0; i < level_cache::group_count; ++i) {
+    level_cache::layer_group& group = cache.groups[i];
+    if (group.first_layer <= layer)
+      add_dirty_rows(group.dirty_begin, group.dirty_end, y, height);
+  }
+}
+
+void level_display::release_level_cache(level_cache& cache) {
+  std::vector<layer_cache>::iterator iter, end = cache.layers.end();
+  for (iter = cache.layers.begin(); iter != end; ++iter) {
+    if (iter->buffer)
+      m_unused_buffers.push_back(iter->buffer);
+    if (iter->tile_texture)
+      m_unused_textures.push_back(iter->tile_texture);
+  }
+  cache.layers.clear();
+  release_level_textures(cache);
+}
+
+void level_display::release_level_textures(level_cache& cache) {
+  for (int i = 0; i < level_cache::group_count; ++i) {
+    level_cache::layer_group& group = cache.groups[i];
+    if (group.texture)
+      m_unused_textures.push_back(group.texture);
+    group.texture = 0;
+  }
+}
+
+void level_display::draw_level(level* current_level, int level_x, int level_y,
+    int view_x, int view_y, int view_width, int view_height) {
+  // Textures only pay off when they aren't scaled down a lot
+  if (!m_use_level_textures || m_zoom < 1.0) {
+    draw_tiles(current_level, level_x, level_y, view_x, view_y, view_width, view_height);
+    return;
+  }
+
+  level_cache& cache = get_level_cache(current_level, level_x, level_y);
+  cache.textured = true;
+
+  const int width = current_level->get_width();
+  const int height = current_level->get_height();
+  const int pixel_width = width * m_tile_width;
+  const int pixel_height = height * m_tile_height;
+
+  // The layers below, at and above the active one
+  const int layer_ranges[level_cache::group_count + 1] = {
+    0,
+    std::min(m_active_layer, cache.layer_count),
+    std::min(m_active_layer + 1, cache.layer_count),
+    cache.layer_count
+  };
+
+  bool rendering = false;
+  for (int i = 0; i < level_cache::group_count; ++i) {
+    level_cache::layer_group& group = cache.groups[i];
+    group.first_layer = layer_ranges[i];
+    group.end_layer = layer_ranges[i + 1];
+
+    if (group.first_layer >= group.end_layer) {
+      if (group.texture)
+        m_unused_textures.push_back(group.texture);
+      group.texture = 0;
+      continue;
+    }
+
+    // Tile size or level size changed
+    if (group.texture &&
+        (group.texture_width != pixel_width || group.texture_height != pixel_height)) {
+      m_unused_textures.push_back(group.texture);
+      group.texture = 0;
+    }
+
+    if (!group.texture) {
+      group.texture_width = pixel_width;
+      group.texture_height = pixel_height;
+      glGenTextures(1, &group.texture);
+      glBindTexture(GL_TEXTURE_2D, group.texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexImage2D(GL_TEXTURE_2D,
+        0, GL_RGBA,
+        pixel_width, pixel_height,
+        0, GL_RGBA, GL_UNSIGNED_BYTE,
+        0);
+
+      group.dirty_begin = 0;
+      group.dirty_end = height;
+    }
+
+    const int dirty_begin = std::max(0, group.dirty_begin);
+    const int dirty_end = std::min(height, group.dirty_end);
+    group.dirty_begin = group.dirty_end = 0;
+    if (dirty_begin >= dirty_end)
+      continue;
+
+    if (!rendering) {
+      rendering = true;
+
+      // Render in level pixels, top row first in the texture
+      glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+      glViewport(0, 0, pixel_width, pixel_height);
+      glMatrixMode(GL_PROJECTION);
+      glPushMatrix();
+      glLoadIdentity();
+      glOrtho(0, pixel_width, 0, pixel_height, -1, 1);
+      glMatrixMode(GL_MODELVIEW);
+      glPushMatrix();
+      glLoadIdentity();
+
+      glEnable(GL_SCISSOR_TEST);
+      // Keep the alpha of the layers so the textures can be put on top of each other
+      glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+      glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, group.texture, 0);
+    glScissor(0, dirty_begin * m_tile_height, pixel_width, (dirty_end - dirty_begin) * m_tile_height);
+    glClear(GL_COLOR_BUFFER_BIT);
+    draw_tiles(current_level, level_x, level_y,
+      0, dirty_begin, width, dirty_end - dirty_begin,
+      group.first_layer, group.end_layer);
+  }
+
+  if (rendering) {
+    glDisable(GL_SCISSOR_TEST);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, get_width(), get_height());
+  }
+
+  // The visible part of the level
+  const int x1 = std::max(0, view_x) * m_tile_width;
+  const int y1 = std::max(0, view_y) * m_tile_height;
+  const int x2 = std::min(width, view_x + view_width) * m_tile_width;
+  const int y2 = std::min(height, view_y + view_height) * m_tile_height;
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  const float u1 = static_cast<float>(x1) / pixel_width;
+  const float v1 = static_cast<float>(y1) / pixel_height;
+  const float u2 = static_cast<float>(x2) / pixel_width;
+  const float v2 = static_cast<float>(y2) / pixel_height;
+
+  // The layer colors are in the textures already, premultiplied by alpha
+  glEnable(GL_TEXTURE_2D);
+  glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  for (int i = 0; i < level_cache::group_count; ++i) {
+    const level_cache::layer_group& group = cache.groups[i];
+    if (!group.texture)
+      continue;
+
+    glBindTexture(GL_TEXTURE_2D, group.texture);
     glBegin(GL_QUADS);
-      glVertex2f(x, y);
-      glVertex2f(x + width, y);
-      glVertex2f(x + width, y + height);
-      glVertex2f(x, y + height);
+      glTexCoord2f(u1, v1);
+      glVertex2i(x1, y1);
+      glTexCoord2f(u2, v1);
+      glVertex2i(x2, y1);
+      glTexCoord2f(u2, v2);
+      glVertex2i(x2, y2);
+      glTexCoord2f(u1, v2);
+      glVertex2i(x1, y2);
     glEnd();
   }
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-  glColor3f(r, g, b);
-  glLineWidth(2);
-  glBegin(GL_LINE_LOOP);
-    glVertex2f(x, y);
-    glVertex2f(x + width, y);
-    glVertex2f(x + width, y + height);
-    glVertex2f(x, y + height);
-  glEnd();
-  glEnable(GL_TEXTURE_2D);
+void level_display::set_layer_color(int layer) {
+  // Draw layers below the current darker, above transparent
+  glColor3f(1.0f, 1.0f, 1.0f);
+  if (m_preferences.fade_layers) {
+    if (layer > m_active_layer) {
+      int level_diff = std::abs(m_active_layer - layer);
+      glColor4f(1.0f, 1.0f, 1.0f, std::pow(0.5f, level_diff));
+    } else if (layer < m_active_layer) {
+      glColor4f(0.5f, 0.5f, 0.5f, 1.0f);
+    }
+  }
 }
 
-void level_display::draw_tiles(level* current_level) {
-  /* Set up the level vertices if we don't have a buffer and are using VBOS
-   * or if we're using vertex arrays and don't have vertices generated */
-  if (((!m_position_buffer || !m_texcoord_buffer) && m_use_vbo) ||
-      (!m_use_vbo && m_positions.empty()))
-    setup_buffers();
+void level_display::draw_tiles(level* current_level, int level_x, int level_y,
+    int view_x, int view_y, int view_width, int view_height,
+    int first_layer, int end_layer) {
+  // Rebuilds the changed rows, if any
+  const level_cache& cache = get_level_cache(current_level, level_x, level_y);
  
   // TODO: handle different tilesets per level
-  // Each tile needs 4 vertices and 4 texcoords
-  const std::size_t size = static_cast<std::size_t>(current_level->get_width() * current_level->get_height() * 4);
-  std::vector<vertex_texcoord> tcoords; tcoords.resize(size);
-
   glEnable(GL_TEXTURE_2D);
   glBindTexture(GL_TEXTURE_2D, m_tileset.index);
 
+  int layer_count = current_level->get_layer_count();
+  if (end_layer >= 0)
+    layer_count = std::min(layer_count, end_layer);
+  const int width = current_level->get_width();
+  const int height = current_level->get_height();
+
+  // The visible tiles, from (x1, y1) up to (x2, y2)
+  const int x1 = std::max(0, view_x);
+  const int y1 = std::max(0, view_y);
+  const int x2 = std::min(width, view_x + view_width);
+  const int y2 = std::min(height, view_y + view_height);
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  if (m_use_tilemap_shader) {
+    m_tilemap_shader.enable(
+      static_cast<float>(m_tile_width)/m_tileset.image_width * m_tileset.width,
+      static_cast<float>(m_tile_height)/m_tileset.image_height * m_tileset.height,
+      width, height);
+
+    // One quad covering the visible tiles per layer, texture coordinates are tiles
+    for (int i = first_layer; i < layer_count; i ++) {
+      if (!get_layer_visibility(i))
+        continue;
+
+      set_layer_color(i);
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, cache.layers[static_cast<std::size_t>(i)].tile_texture);
+      glActiveTexture(GL_TEXTURE0);
+
+      glBegin(GL_QUADS);
+        glTexCoord2f(x1, y1);
+        glVertex2i(x1 * m_tile_width, y1 * m_tile_height);
+        glTexCoord2f(x2, y1);
+        glVertex2i(x2 * m_tile_width, y1 * m_tile_height);
+        glTexCoord2f(x2, y2);
+        glVertex2i(x2 * m_tile_width, y2 * m_tile_height);
+        glTexCoord2f(x1, y2);
+        glVertex2i(x1 * m_tile_width, y2 * m_tile_height);
+      glEnd();
+    }
+
+    m_tilemap_shader.disable();
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return;
+  }
+
   glEnableClientState(GL_VERTEX_ARRAY);
   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 
@@ -917,100 +1451,58 @@ void level_display::draw_tiles(level* current_level) {
     // Bind VBOs
     glBindBuffer(GL_ARRAY_BUFFER, m_position_buffer);
     glVertexPointer(2, GL_INT, sizeof(vertex_position), 0);
-    glBindBuffer(GL_ARRAY_BUFFER, m_texcoord_buffer);
   } else {
     // Link vertex array
     glVertexPointer(2, GL_INT, sizeof(vertex_position), &m_positions.front());
   }
 
   // Draw each layer
-  int layer_count = current_level->get_layer_count();
-  for (int i = 0; i < layer_count; i ++) {
+  for (int i = first_layer; i < layer_count; i ++) {
     // If it's visible
     if (get_layer_visibility(i)) {
-      // With its own set of tiles
-      tile_buf& tiles = current_level->get_tiles(i);
-      const int width = tiles.get_width();
-      const int height = tiles.get_height();
-
-      // Draw layers below the current darker, above transparent
-      glColor3f(1.0f, 1.0f, 1.0f);
-      if (m_preferences.fade_layers) {
-        if (i > m_active_layer) {
-          int level_diff = std::abs(m_active_layer - i);
-          glColor4f(1.0f, 1.0f, 1.0f, std::pow(0.5f, level_diff));
-        } else if (i < m_active_layer) {
-          glColor4f(0.5f, 0.5f, 0.5f, 1.0f);
-        }
-      }
-
-      /* We need to draw this in chunks so we can skip transparent tiles */
-      int current_start = 0;
-      int current_length = 0;
-      std::list<std::pair<int, int> > chunks;
-      // Build texture coordinates
-      for (int x = 0; x < width; ++x) {
-        for (int y = 0; y < height; ++y) {
-          const tile& _tile = tiles.get_tile(x, y);
-          // Add a new chunk once a transparent tile is reached
-          if (_tile == Graal::tile_transparent) {
-            if (current_length > 0) {
-              chunks.push_back(std::pair<int, int>(current_start, current_length));
-              current_start += current_length;
-              current_length = 0;
-            }
-
-            // Skip this tile
-            current_start ++;
-            continue;
-          }
+      const layer_cache& layer = cache.layers[static_cast<std::size_t>(i)];
 
-          // The position of the actual tile inside the tileset
-          const int tx = helper::get_tile_x(_tile.index);
-          const int ty = helper::get_tile_y(_tile.index);
-
-          // Build texture coordinates
-          float x1 = static_cast<float>(tx * m_tile_width)/m_tileset.image_width * m_tileset.width;
-          float x2 = static_cast<float>((tx+1)*m_tile_width)/m_tileset.image_width * m_tileset.width;
-          float y1 = static_cast<float>(ty*m_tile_height)/m_tileset.image_height * m_tileset.height;
-          float y2 = static_cast<float>((ty+1)*m_tile_height)/m_tileset.image_height * m_tileset.height;
-          
-          // Fill texcoord array at the current vertex position
-          int index = (x * height + y) * 4;
-
-          tcoords[index++] = vertex_texcoord(x1, y1);
-          tcoords[index++] = vertex_texcoord(x2, y1);
-          tcoords[index++] = vertex_texcoord(x2, y2);
-          tcoords[index  ] = vertex_texcoord(x1, y2);
-
-          current_length ++;
-        }
-      }
-      // And one last chunk
-      if (current_length > 0) {
-        chunks.push_back(std::pair<int, int>(current_start, current_length));
-      }
+      set_layer_color(i);
 
       if (m_use_vbo) {
-        // Upload texture coordinates and draw buffer
-        glBufferData(GL_ARRAY_BUFFER,
-                     tcoords.size() * sizeof(vertex_texcoord),
-                     &tcoords.front(),
-                     GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, layer.buffer);
         glTexCoordPointer(2, GL_FLOAT, 0, 0);
       } else {
         // Link texcoord array
-        glTexCoordPointer(2, GL_FLOAT, 0, &tcoords.front());
+        glTexCoordPointer(2, GL_FLOAT, 0, &layer.tcoords.front());
       }
-      // Draw all collected chunks
-      std::list<std::pair<int, int> >::iterator iter, end = chunks.end();
-      for (iter = chunks.begin(); iter != end; ++iter) {
-        // Indices are per tile, but we draw 4 vertices per tile
-        glDrawArrays(GL_QUADS, iter->first * 4, iter->second * 4);
+
+      // Draw the visible parts of the chunks, joining those continuing into the next row
+      int start = 0, length = 0;
+      for (int y = y1; y < y2; ++y) {
+        const std::vector<std::pair<int, int> >& chunks = layer.row_chunks[static_cast<std::size_t>(y)];
+        const int row_begin = y * width + x1;
+        const int row_end = y * width + x2;
+        std::vector<std::pair<int, int> >::const_iterator iter, end = chunks.end();
+        for (iter = chunks.begin(); iter != end; ++iter) {
+          const int chunk_begin = std::max(row_begin, iter->first);
+          const int chunk_end = std::min(row_end, iter->first + iter->second);
+          if (chunk_begin >= chunk_end)
+            continue;
+
+          if (length > 0 && start + length == chunk_begin) {
+            length += chunk_end - chunk_begin;
+            continue;
+          }
+          // Indices are per tile, but we draw 4 vertices per tile
+          if (length > 0)
+            glDrawArrays(GL_QUADS, start * 4, length * 4);
+          start = chunk_begin;
+          length = chunk_end - chunk_begin;
+        }
       }
+      if (length > 0)
+        glDrawArrays(GL_QUADS, start * 4, length * 4);
     }
   }
 
+  if (m_use_vbo)
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
   glDisableClientState(GL_VERTEX_ARRAY);
   glDisableClientState(GL_TEXTURE_COORD_ARRAY);
   glBindTexture(GL_TEXTURE_2D, 0);
@@ -1064,41 +1556,89 @@ void level_display::draw_selection() {
   }
 }
 
-void level_display::draw_misc(level* current_level) {
-  // NPCs
-  if (!m_preferences.hide_npcs) {
-    glColor3f(1.0f, 1.0f, 1.0f);
-    Graal::level::npc_list_type::iterator npc_iter, npc_end = current_level->npcs.end();
-    for (npc_iter = current_level->npcs.begin(); npc_iter != npc_end; npc_iter ++) {
-      const int x = static_cast<int>(npc_iter->get_level_x() * m_tile_width);
-      const int y = static_cast<int>(npc_iter->get_level_y() * m_tile_height);
-      const std::string& npc_image_file = npc_iter->image;
-      Cairo::RefPtr<Cairo::ImageSurface>& npc_img = m_image_cache.get_image(npc_image_file);
-      const int width = npc_img->get_width();
-      const int height = npc_img->get_height();
-      
-      const texture_info& tex = m_texture_cache.get_texture(npc_image_file);
-      glBindTexture(GL_TEXTURE_2D, tex.index);
-      glBegin(GL_QUADS);
-        glTexCoord2f(0.0f, 0.0f);
-        glVertex2f(x, y);
-        glTexCoord2f(tex.width, 0.0f);
-        glVertex2f(x+width, y);
-        glTexCoord2f(tex.width, tex.height);
-        glVertex2f(x+width, y+height);
-        glTexCoord2f(0.0f, tex.height);
-        glVertex2f(x, y+height);
-      glEnd();
-      glBindTexture(GL_TEXTURE_2D, 0);
+void level_display::draw_npcs(const visible_level_list_type& levels, int view_x, int view_y, int view_width, int view_height) {
+  if (m_preferences.hide_npcs)
+    return;
+
+  // The visible part of the map in pixels
+  const int left = view_x * m_tile_width;
+  const int top = view_y * m_tile_height;
+  const int right = (view_x + view_width) * m_tile_width;
+  const int bottom = (view_y + view_height) * m_tile_height;
+
+  const int level_width = m_level_map->get_level_width() * m_tile_width;
+  const int level_height = m_level_map->get_level_height() * m_tile_height;
+
+  npc_batch_list_type::iterator batch, batches_end = m_npc_batches.end();
+  for (batch = m_npc_batches.begin(); batch != batches_end; ++batch) {
+    batch->second.positions.clear();
+    batch->second.tcoords.clear();
+  }
+
+  // Collect the quads by texture, most NPCs share an atlas page
+  visible_level_list_type::const_iterator iter, end = levels.end();
+  for (iter = levels.begin(); iter != end; ++iter) {
+    const int level_x = iter->first.first * level_width;
+    const int level_y = iter->first.second * level_height;
+
+    Graal::level::npc_list_type::iterator npc_iter, npc_end = iter->second->npcs.end();
+    for (npc_iter = iter->second->npcs.begin(); npc_iter != npc_end; npc_iter ++) {
+      const int x = level_x + static_cast<int>(npc_iter->get_level_x() * m_tile_width);
+      const int y = level_y + static_cast<int>(npc_iter->get_level_y() * m_tile_height);
+      // The texture knows the image size, so no image lookup is needed
+      const texture_info& tex = m_texture_cache.get_atlas_texture(npc_iter->image);
+      const int width = tex.image_width;
+      const int height = tex.image_height;
+
+      if (x >= right || y >= bottom || x + width <= left || y + height <= top)
+        continue;
+
+      npc_batch& npcs = m_npc_batches[tex.index];
+      npcs.positions.push_back(vertex_position(x, y));
+      npcs.positions.push_back(vertex_position(x + width, y));
+      npcs.positions.push_back(vertex_position(x + width, y + height));
+      npcs.positions.push_back(vertex_position(x, y + height));
+      npcs.tcoords.push_back(vertex_texcoord(tex.x, tex.y));
+      npcs.tcoords.push_back(vertex_texcoord(tex.x + tex.width, tex.y));
+      npcs.tcoords.push_back(vertex_texcoord(tex.x + tex.width, tex.y + tex.height));
+      npcs.tcoords.push_back(vertex_texcoord(tex.x, tex.y + tex.height));
     }
   }
 
+  glColor3f(1.0f, 1.0f, 1.0f);
+  glEnable(GL_TEXTURE_2D);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+  for (batch = m_npc_batches.begin(); batch != batches_end; ++batch) {
+    const npc_batch& npcs = batch->second;
+    if (npcs.positions.empty())
+      continue;
+
+    glBindTexture(GL_TEXTURE_2D, batch->first);
+    glVertexPointer(2, GL_INT, sizeof(vertex_position), &npcs.positions.front());
+    glTexCoordPointer(2, GL_FLOAT, sizeof(vertex_texcoord), &npcs.tcoords.front());
+    glDrawArrays(GL_QUADS, 0, static_cast<GLsizei>(npcs.positions.size()));
+  }
+
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void level_display::draw_misc(level* current_level, int level_x, int level_y, int view_x, int view_y, int view_width, int view_height) {
+  // Overlays are batched over all levels, so they need map positions
+  const int origin_x = level_x * current_level->get_width() * m_tile_width;
+  const int origin_y = level_y * current_level->get_height() * m_tile_height;
+
   // Signs
   if (!m_preferences.hide_signs) {
-    Graal::level::sign_list_type::iterator sign_iter, sign_end = current_level->signs.end();
-    for (sign_iter = current_level->signs.begin(); sign_iter != sign_end; sign_iter ++) {
+    Graal::level::sign_query_type visible_signs;
+    current_level->find_signs(view_x, view_y, view_width, view_height, visible_signs);
+    Graal::level::sign_query_type::iterator sign_iter, sign_end = visible_signs.end();
+    for (sign_iter = visible_signs.begin(); sign_iter != sign_end; sign_iter ++) {
       draw_rectangle(
-        sign_iter->x * m_tile_width, sign_iter->y * m_tile_height,
+        origin_x + (*sign_iter)->x * m_tile_width, origin_y + (*sign_iter)->y * m_tile_height,
         2 * m_tile_width, 1 * m_tile_height, // Signs are by default 2x1 tiles big
         1.0f, 0.0f, 0.0f, 0.2f,
         true);
@@ -1107,23 +1647,174 @@ void level_display::draw_misc(level* current_level) {
 
   // Links
   if (!m_preferences.hide_links) {
-    Graal::level::link_list_type::iterator link_iter, link_end = current_level->links.end();
-    for (link_iter = current_level->links.begin(); link_iter != link_end; link_iter ++) {
+    Graal::level::link_query_type visible_links;
+    current_level->find_links(view_x, view_y, view_width, view_height, visible_links);
+    Graal::level::link_query_type::iterator link_iter, link_end = visible_links.end();
+    for (link_iter = visible_links.begin(); link_iter != link_end; link_iter ++) {
       draw_rectangle(
-        link_iter->x * m_tile_width, link_iter->y * m_tile_height,
-        link_iter->width * m_tile_width, link_iter->height * m_tile_height,
+        origin_x + (*link_iter)->x * m_tile_width, origin_y + (*link_iter)->y * m_tile_height,
+        (*link_iter)->width * m_tile_width, (*link_iter)->height * m_tile_height,
         1.0f, 1.0f, 0.4f, 0.2f,
         true);
     }
   }
 }
 
+namespace {
+  // Zoomed tile size in pixels below which levels are drawn as thumbnails
+  const double thumbnail_tile_size = 4.0;
+  // Seconds per frame spent making thumbnails before drawing the rest later
+  const double thumbnail_time_budget = 0.02;
+}
+
+void level_display::draw_thumbnails(int start_x, int start_y, int end_x, int end_y) {
+  // Redo all with the new tileset or layers
+  if (m_thumbnail_tileset_generation != m_tileset_generation ||
+      m_thumbnail_layer_visibility != m_layer_visibility) {
+    m_thumbnail_tileset_generation = m_tileset_generation;
+    m_thumbnail_layer_visibility = m_layer_visibility;
+
+    thumbnail_list_type::iterator iter, end = m_thumbnails.end();
+    for (iter = m_thumbnails.begin(); iter != end; ++iter)
+      iter->second.stale = true;
+  }
+
+  const int level_width = m_level_map->get_level_width() * m_tile_width;
+  const int level_height = m_level_map->get_level_height() * m_tile_height;
+
+  Glib::Timer timer;
+  timer.start();
+  bool finished = true;
+
+  glEnable(GL_TEXTURE_2D);
+  glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+  for (int y = start_y; y < end_y; y++) {
+    for (int x = start_x; x < end_x; x++) {
+      level_thumbnail& thumbnail = m_thumbnails[std::make_pair(x, y)];
+      if (thumbnail.stale) {
+        // Making one loads the level, which takes a while for unloaded ones
+        if (timer.elapsed() < thumbnail_time_budget) {
+          update_thumbnail(thumbnail, m_level_map->get_level(x, y).get());
+        } else {
+          finished = false;
+        }
+      }
+
+      if (!thumbnail.texture)
+        continue;
+
+      glBindTexture(GL_TEXTURE_2D, thumbnail.texture);
+      glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, 0.0f);
+        glVertex2i(x * level_width, y * level_height);
+        glTexCoord2f(1.0f, 0.0f);
+        glVertex2i((x + 1) * level_width, y * level_height);
+        glTexCoord2f(1.0f, 1.0f);
+        glVertex2i((x + 1) * level_width, (y + 1) * level_height);
+        glTexCoord2f(0.0f, 1.0f);
+        glVertex2i(x * level_width, (y + 1) * level_height);
+      glEnd();
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  // Continue with the rest in the next frame
+  if (!finished)
+    invalidate();
+}
+
+void level_display::update_thumbnail(level_thumbnail& thumbnail, level* current_level) {
+  thumbnail.stale = false;
+  if (!current_level) {
+    if (thumbnail.texture)
+      m_unused_textures.push_back(thumbnail.texture);
+    thumbnail.texture = 0;
+    return;
+  }
+
+  const int width = current_level->get_width();
+  const int height = current_level->get_height();
+  const int layer_count = current_level->get_layer_count();
+
+  // Blend the average tile colors of the visible layers, all premultiplied
+  std::vector<guint32> pixels(static_cast<std::size_t>(width * height), 0);
+  for (int i = 0; i < layer_count; ++i) {
+    if (!get_layer_visibility(i))
+      continue;
+
+    const tile_buf& tiles = current_level->get_tiles(i);
+    for (int y = 0; y < height; ++y) {
+      const tile* row = tiles.get_row(y);
+      guint32* pixel_row = &pixels[static_cast<std::size_t>(y * width)];
+      for (int x = 0; x < width; ++x) {
+        const guint32 color = get_tile_color(row[x]);
+        const guint32 alpha = color >> 24;
+        if (alpha == 0xff) {
+          pixel_row[x] = color;
+        } else if (alpha > 0) {
+          guint32 blended = 0;
+          for (int channel = 0; channel < 4; ++channel) {
+            const guint32 below = (pixel_row[x] >> (channel * 8)) & 0xff;
+            const guint32 above = (color >> (channel * 8)) & 0xff;
+            blended |= std::min<guint32>(0xff, above + below * (0xff - alpha) / 0xff) << (channel * 8);
+          }
+          pixel_row[x] = blended;
+        }
+      }
+    }
+  }
+
+  if (!thumbnail.texture) {
+    glGenTextures(1, &thumbnail.texture);
+    glBindTexture(GL_TEXTURE_2D, thumbnail.texture);
+    // Every tile stays a sharp square of its color
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  } else {
+    glBindTexture(GL_TEXTURE_2D, thumbnail.texture);
+  }
+
+  // Same pixel layout as the cairo surfaces loaded in load_texture_from_surface
+  glTexImage2D(GL_TEXTURE_2D,
+    0, GL_RGBA,
+    width, height,
+    0, GL_BGRA, GL_UNSIGNED_BYTE,
+    &pixels.front());
+}
+
+void level_display::release_thumbnails() {
+  thumbnail_list_type::iterator iter, end = m_thumbnails.end();
+  for (iter = m_thumbnails.begin(); iter != end; ++iter) {
+    if (iter->second.texture)
+      m_unused_textures.push_back(iter->second.texture);
+  }
+  m_thumbnails.clear();
+}
+
 void level_display::draw_all() { 
+  if (!m_unused_buffers.empty()) {
+    glDeleteBuffers(static_cast<GLsizei>(m_unused_buffers.size()), &m_unused_buffers.front());
+    m_unused_buffers.clear();
+  }
+  if (!m_unused_textures.empty()) {
+    glDeleteTextures(static_cast<GLsizei>(m_unused_textures.size()), &m_unused_textures.front());
+    m_unused_textures.clear();
+  }
+
+  /* Set up the level vertices if we don't have a buffer and are using VBOS
+   * or if we're using vertex arrays and don't have vertices generated */
+  if ((!m_position_buffer && m_use_vbo) ||
+      (!m_use_vbo && m_positions.empty()))
+    setup_buffers();
+
   // Apply scroll offset
   int offset_x, offset_y;
   get_scroll_offset(offset_x, offset_y);
   glPushMatrix();
   glTranslatef(-offset_x, -offset_y, 0);
+  glScalef(m_zoom, m_zoom, 1);
 
   const int map_width = m_level_map->get_width();
   const int map_height = m_level_map->get_height();
@@ -1131,64 +1822,132 @@ void level_display::draw_all() {
   const int level_width = m_level_map->get_level_width();
   const int level_height = m_level_map->get_level_height();
 
-  int new_current_level_x = helper::bound_by((offset_x + get_width()/2)/m_tile_width/level_width, 0, map_width);
-  int new_current_level_y = helper::bound_by((offset_y + get_height()/2)/m_tile_height/level_height, 0, map_height);
-
-  //if (m_level_map->get_level(
-  m_current_level_x = new_current_level_x;
-  m_current_level_y = new_current_level_y;
-
-  // Send level name changed and unsaved changed signals
-  m_signal_title_changed(get_current_level_path().filename().string());
-  m_signal_unsaved_status_changed(m_unsaved_levels[std::pair<int, int>(m_current_level_x, m_current_level_y)]);
-
-  // Draw surrounding levels
-  const int start_x = std::max(0, m_current_level_x - 1);
-  const int start_y = std::max(0, m_current_level_y - 1);
-  const int end_x = std::min(map_width - 1, m_current_level_x + 1) + 1;
-  const int end_y = std::min(map_height - 1, m_current_level_y + 1) + 1;
+  // The visible part of the map in unzoomed pixels
+  const int pixel_x = static_cast<int>(offset_x / m_zoom);
+  const int pixel_y = static_cast<int>(offset_y / m_zoom);
+  const int pixel_end_x = static_cast<int>(std::ceil((offset_x + get_width()) / m_zoom));
+  const int pixel_end_y = static_cast<int>(std::ceil((offset_y + get_height()) / m_zoom));
+
+  int new_current_level_x = helper::bound_by((pixel_x + pixel_end_x)/2/m_tile_width/level_width, 0, map_width);
+  int new_current_level_y = helper::bound_by((pixel_y + pixel_end_y)/2/m_tile_height/level_height, 0, map_height);
+
+  if (new_current_level_x != m_current_level_x ||
+      new_current_level_y != m_current_level_y ||
+      m_current_level_changed) {
+    m_current_level_x = new_current_level_x;
+    m_current_level_y = new_current_level_y;
+    m_current_level_changed = false;
+
+    // Send level name changed and unsaved changed signals
+    m_signal_title_changed(get_current_level_path().filename().string());
+    m_signal_unsaved_status_changed(m_unsaved_levels[std::pair<int, int>(m_current_level_x, m_current_level_y)]);
+  }
 
-  // Do this in two loops so the tiles get drawn below everything
-  // TODO: enable z buffer again?
-  // TODO: do bounds checking with viewport to only draw those levels that are actually visible
-  for (int x = start_x; x < end_x; x++) {
+  // The visible part of the map in tiles
+  const int view_x = pixel_x / m_tile_width;
+  const int view_y = pixel_y / m_tile_height;
+  const int view_width = (pixel_end_x + m_tile_width - 1) / m_tile_width - view_x;
+  const int view_height = (pixel_end_y + m_tile_height - 1) / m_tile_height - view_y;
+
+  // Only the levels intersecting it get drawn
+  const int start_x = std::max(0, view_x / level_width);
+  const int start_y = std::max(0, view_y / level_height);
+  const int end_x = std::min(map_width, (view_x + view_width + level_width - 1) / level_width);
+  const int end_y = std::min(map_height, (view_y + view_height + level_height - 1) / level_height);
+
+  /* Look every level up once. Holding on to them until the frame is done
+   * keeps evict_levels from dropping levels that are still on screen */
+  visible_level_list_type visible_levels;
+
+  // Tiles this small are only colored dots, so draw whole levels at once
+  if (m_zoom * m_tile_width < thumbnail_tile_size) {
+    draw_thumbnails(start_x, start_y, end_x, end_y);
+  } else {
     for (int y = start_y; y < end_y; y++) {
-      const int screen_level_x = x * level_width * m_tile_width;
-      const int screen_level_y = y * level_height * m_tile_height;
-      level* current_level = m_level_map->get_level(x, y).get();
-      // Draw level at the correct position
-      if (current_level) {
-        glPushMatrix();
-        glTranslatef(screen_level_x, screen_level_y, 0);
-        draw_tiles(current_level);
-        glPopMatrix();
+      for (int x = start_x; x < end_x; x++) {
+        const boost::shared_ptr<level>& current_level = m_level_map->get_level(x, y);
+        if (current_level)
+          visible_levels.push_back(std::make_pair(std::make_pair(x, y), current_level));
       }
     }
-  }
 
-  for (int x = start_x; x < end_x; x++) {
-    for (int y = start_y; y < end_y; y++) {
-      const int screen_level_x = x * level_width * m_tile_width;
-      const int screen_level_y = y * level_height * m_tile_height;
-      level* current_level = m_level_map->get_level(x, y).get();
-      if (current_level) {
-        // Draw level at the correct position
-        glPushMatrix();
-        glTranslatef(screen_level_x, screen_level_y, 0);
-        draw_misc(current_level);
-        glPopMatrix();
-      }
+    // Do this in two loops so the tiles get drawn below everything
+    // TODO: enable z buffer again?
+    visible_level_list_type::const_iterator iter, end = visible_levels.end();
+    for (iter = visible_levels.begin(); iter != end; ++iter) {
+      const int x = iter->first.first;
+      const int y = iter->first.second;
+      // Draw level at the correct position
+      glPushMatrix();
+      glTranslatef(x * level_width * m_tile_width, y * level_height * m_tile_height, 0);
+      draw_level(iter->second.get(), x, y,
+        view_x - x * level_width, view_y - y * level_height,
+        view_width, view_height);
+      glPopMatrix();
+    }
+
+    draw_npcs(visible_levels, view_x, view_y, view_width, view_height);
+
+    for (iter = visible_levels.begin(); iter != end; ++iter) {
+      const int x = iter->first.first;
+      const int y = iter->first.second;
+      draw_misc(iter->second.get(), x, y,
+        view_x - x * level_width, view_y - y * level_height,
+        view_width, view_height);
     }
+    m_overlays.flush();
   }
 
   draw_selection();
+  m_overlays.flush();
 
   glPopMatrix();
+
+  // Nothing else holds on to levels between frames, so unload unused ones now
+  m_level_map->evict_levels();
+  visible_levels.clear();
+
+  /* Forget the caches of unloaded levels, and the level textures of levels
+   * that weren't drawn with them, they are big */
+  const level_map::level_list_type& loaded_levels = m_level_map->get_levels();
+  level_cache_list_type::iterator cache_iter = m_level_caches.begin();
+  while (cache_iter != m_level_caches.end()) {
+    if (loaded_levels.find(cache_iter->first) == loaded_levels.end()) {
+      release_level_cache(cache_iter->second);
+      m_level_caches.erase(cache_iter++);
+    } else {
+      if (!cache_iter->second.textured)
+        release_level_textures(cache_iter->second);
+      cache_iter->second.textured = false;
+      ++cache_iter;
+    }
+  }
 }
 
 void level_display::setup_buffers() {
   m_use_vbo = glewIsSupported("GL_ARB_vertex_buffer_object");
 
+  // Levels are rendered into textures once if they fit into one
+  GLint max_texture_size = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+  m_use_level_textures =
+    (GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object) &&
+    m_level_map->get_level_width() * m_tile_width <= max_texture_size &&
+    m_level_map->get_level_height() * m_tile_height <= max_texture_size;
+  if (m_use_level_textures && !m_framebuffer)
+    glGenFramebuffers(1, &m_framebuffer);
+
+  // Falls back to the vertex arrays below without shader support
+  const bool use_tilemap_shader = m_preferences.use_tile_shader && m_tilemap_shader.init();
+  if (use_tilemap_shader != m_use_tilemap_shader) {
+    // The caches only hold the data of one way to draw
+    level_cache_list_type::iterator iter, end = m_level_caches.end();
+    for (iter = m_level_caches.begin(); iter != end; ++iter)
+      release_level_cache(iter->second);
+    m_level_caches.clear();
+    m_use_tilemap_shader = use_tilemap_shader;
+  }
+
   if (!m_use_vbo) {
     std::cerr << "level_display::setup_buffers: no ARB_vertex_buffer_object support, using vertex arrays" << std::endl;
   }
@@ -1196,8 +1955,6 @@ void level_display::setup_buffers() {
   if (m_use_vbo) {
     if (!m_position_buffer)
       glGenBuffers(1, &m_position_buffer);
-    if (!m_texcoord_buffer)
-      glGenBuffers(1, &m_texcoord_buffer);
   }
 
   // Each tile needs 4 vertices and 4 texcoords
@@ -1207,9 +1964,9 @@ void level_display::setup_buffers() {
 
   m_positions.reserve(size);
 
-  // fill with vertex positions
-  for (int x = 0; x < width; ++x) {
-    for (int y = 0; y < height; ++y) {
+  // fill with vertex positions, row by row so changed rows are contiguous
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
       const int tx = x * m_tile_width;
       const int ty = y * m_tile_height;
       m_positions.push_back(vertex_position(tx, ty));
@@ -1249,8 +2006,8 @@ const boost::shared_ptr<level>& level_editor::level_display::get_current_level()
 void level_editor::level_display::set_surface_size() {
   level_editor::ogl_tiles_display::set_surface_size();
   set_scroll_size(
-    m_level_map->get_width_tiles() * m_tile_width,
-    m_level_map->get_height_tiles() * m_tile_height);
+    static_cast<int>(m_level_map->get_width_tiles() * m_tile_width * m_zoom),
+    static_cast<int>(m_level_map->get_height_tiles() * m_tile_height * m_zoom));
 }
 
 const boost::filesystem::path level_editor::level_display::get_current_level_path() const {
@@ -1259,19 +2016,81 @@ const boost::filesystem::path level_editor::level_display::get_current_level_pat
 
 void level_editor::level_display::set_unsaved(int level_x, int level_y, bool new_unsaved) {
   std::pair<int, int> level_key(level_x, level_y);
-  m_unsaved_levels[level_key] = new_unsaved;
-  
-  m_signal_unsaved_status_changed(new_unsaved);
+  bool& unsaved = m_unsaved_levels[level_key];
+  const bool changed = (unsaved != new_unsaved);
+  unsaved = new_unsaved;
+
+  /* Keep edited levels loaded even after saving them, the undo history
+   * refers to their NPCs by id which wouldn't survive a reload */
+  if (new_unsaved)
+    m_level_map->set_level_modified(level_x, level_y, true);
+
+  // Only the current level's status is shown
+  if (changed && level_x == m_current_level_x && level_y == m_current_level_y)
+    m_signal_unsaved_status_changed(new_unsaved);
 }
 
 void level_editor::level_display::focus_level(int level_x, int level_y) {
   set_scroll_offset(
-    level_x * m_level_map->get_level_width() * m_tile_width,
-    level_y * m_level_map->get_level_height() * m_tile_height);
+    static_cast<int>(level_x * m_level_map->get_level_width() * m_tile_width * m_zoom),
+    static_cast<int>(level_y * m_level_map->get_level_height() * m_tile_height * m_zoom));
+}
+
+void level_editor::level_display::zoom(double new_zoom, int anchor_x, int anchor_y) {
+  // Between a whole 64x64 GMap fitting into a small window and 4x
+  new_zoom = std::max(1.0 / 256, std::min(4.0, new_zoom));
+
+  int ox, oy;
+  get_scroll_offset(ox, oy);
+  const double map_x = (ox + anchor_x) / m_zoom;
+  const double map_y = (oy + anchor_y) / m_zoom;
+
+  set_zoom(new_zoom);
+  set_scroll_offset(
+    static_cast<int>(map_x * m_zoom) - anchor_x,
+    static_cast<int>(map_y * m_zoom) - anchor_y);
+  invalidate();
 }
 
-void level_display::on_level_changed(int x, int y) {
-  set_unsaved(x, y, true);
+void level_editor::level_display::zoom(double new_zoom) {
+  zoom(new_zoom, get_width() / 2, get_height() / 2);
+}
+
+bool level_display::on_scroll(GdkEventScroll* event) {
+  // Plain scrolling is left to the scrolled window
+  if (!(event->state & GDK_CONTROL_MASK))
+    return false;
+
+  if (event->direction == GDK_SCROLL_UP)
+    zoom(m_zoom * 1.25, static_cast<int>(event->x), static_cast<int>(event->y));
+  else if (event->direction == GDK_SCROLL_DOWN)
+    zoom(m_zoom / 1.25, static_cast<int>(event->x), static_cast<int>(event->y));
+
+  return true;
+}
+
+void level_display::on_level_changed(const level_map::dirty_rect_list_type& rects) {
+  // One unsaved status update for the whole batch of changes
+  const std::pair<int, int> current_key(m_current_level_x, m_current_level_y);
+  const bool was_unsaved = m_unsaved_levels[current_key];
+  level_map::dirty_rect_list_type::const_iterator iter, end = rects.end();
+  for (iter = rects.begin(); iter != end; ++iter) {
+    const std::pair<int, int> level_key(iter->level_x, iter->level_y);
+    // Undoing back to the saved state makes a level saved again
+    m_unsaved_levels[level_key] = m_level_map->is_level_changed(iter->level_x, iter->level_y);
+    m_level_map->set_level_modified(iter->level_x, iter->level_y, true);
+
+    // Changed tiles might uncover or hide others on all layers
+    if (iter->layer >= 0)
+      invalidate_level_cache(iter->level_x, iter->level_y, iter->layer, iter->y, iter->height);
+
+    thumbnail_list_type::iterator thumbnail = m_thumbnails.find(level_key);
+    if (thumbnail != m_thumbnails.end())
+      thumbnail->second.stale = true;
+  }
+
+  if (m_unsaved_levels[current_key] != was_unsaved)
+    m_signal_unsaved_status_changed(m_unsaved_levels[current_key]);
 }
 
 bool level_display::on_key_press_event(GdkEventKey* event) {
@@ -1294,6 +2113,15 @@ bool level_display::on_key_press_event(GdkEventKey* event) {
   case GDK_Down:
     oy += step_y;
     break;
+  case GDK_plus:
+  case GDK_equal:
+  case GDK_KP_Add:
+    zoom(m_zoom * 1.25);
+    return true;
+  case GDK_minus:
+  case GDK_KP_Subtract:
+    zoom(m_zoom / 1.25);
+    return true;
   }
   set_scroll_offset(ox, oy);
 
@@ -10,6 +10,8 @@
 #include "image_cache.hpp"
 #include "ogl_tiles_display.hpp"
 #include "ogl_texture_cache.hpp"
+#include "ogl_tilemap_shader.hpp"
+#include "ogl_overlay_batch.hpp"
 
 #include "level_map.hpp"
 
@@ -50,6 +52,9 @@ public:
 
   // Sets the used level map
   void set_level_map(level_map_source* _level_map);
+  /* Sets the registry to share levels with other displays through, for
+   * level maps set afterwards */
+  void set_level_registry(const boost::shared_ptr<level_registry>& registry);
   void load_level(const boost::filesystem::path& file_path);
   void load_gmap(filesystem& fs, const boost::filesystem::path& file_path);
 
@@ -64,9 +69,10 @@ public:
 
   // Create new npc at mouse
   Graal::npc& drag_new_npc();
-  // TODO: use c++0x move semantics, tiles will be swapped with the
-  // current selection and then hopefully discarded
-  void drag_selection(tile_buf& tiles, int drag_x, int drag_y);
+  // Reports a change to the links, signs or NPCs of the current level
+  void mark_current_level_changed();
+  // The tiles become the new selection
+  void drag_selection(BOOST_RV_REF(tile_buf) tiles, int drag_x, int drag_y);
   void drag_selection(const level_map::npc_ref& ref);
   // Adds the npc to the level and start dragging it
   void drag_selection(const npc& _npc);
@@ -74,6 +80,11 @@ public:
   // Scrolls to the specified level
   void focus_level(int level_x = 0, int level_y = 0);
 
+  /* Zooms keeping the map position under the given widget position in
+   * place, or the center without one */
+  void zoom(double zoom, int anchor_x, int anchor_y);
+  void zoom(double zoom);
+
 
   inline int to_tiles_x(int x);
   inline int to_tiles_y(int y);
@@ -123,13 +134,32 @@ public:
 
   void set_surface_size();
 protected:
-  void draw_tiles(level* current_level);
+  /* Draws the tiles inside the passed level-local tile rectangle, of the
+   * layers from first_layer up to end_layer or all above first_layer if
+   * end_layer is negative */
+  void draw_tiles(level* current_level, int level_x, int level_y,
+                  int view_x, int view_y, int view_width, int view_height,
+                  int first_layer = 0, int end_layer = -1);
+  // Like draw_tiles, but through the level's textures when they are used
+  void draw_level(level* current_level, int level_x, int level_y,
+                  int view_x, int view_y, int view_width, int view_height);
+  // Sets the color to draw a layer with, fading layers other than the active one
+  void set_layer_color(int layer);
   void draw_selection();
-  void draw_misc(level* current_level);
+  typedef std::vector<std::pair<std::pair<int, int>, boost::shared_ptr<level> > >
+    visible_level_list_type;
+
+  // Draws the NPCs of all levels intersecting the passed tile rectangle in batches
+  void draw_npcs(const visible_level_list_type& levels, int view_x, int view_y, int view_width, int view_height);
+  // Queues the links/signs intersecting the passed level-local tile rectangle as overlays
+  void draw_misc(level* current_level, int level_x, int level_y, int view_x, int view_y, int view_width, int view_height);
+  // Appends a description of the links and signs at the given global tile to str
+  void describe_objects_at(std::ostream& str, int tile_x, int tile_y);
   virtual void draw_all();
   
   void setup_buffers();
 
+  // Queues a rectangle in m_overlays, drawn with the next flush
   void draw_rectangle(float x, float y, float width, float height, float r, float g, float b, float a = 1.0, bool fill = false);
   //virtual bool on_expose_event(GdkEventExpose* event);
   void on_button_pressed(GdkEventButton* event);
@@ -137,12 +167,17 @@ protected:
   void on_button_motion(GdkEventMotion* event);
   void on_mouse_leave(GdkEventCrossing* event);
   bool on_key_press_event(GdkEventKey* event);
+  bool on_scroll(GdkEventScroll* event);
 
-  void on_level_changed(int x, int y);
+  void on_level_changed(const level_map::dirty_rect_list_type& rects);
+  /* Saves the current level, unless it matches its file and force isn't
+   * set, plus the other unsaved levels of single file sources */
+  void save_levels(bool force);
 
   int m_current_level_x, m_current_level_y;
   boost::shared_ptr<level_map> m_level_map;
   boost::shared_ptr<level_map_source> m_level_source;
+  boost::shared_ptr<level_registry> m_level_registry;
 
   preferences& m_preferences;
 
@@ -166,6 +201,8 @@ protected:
 private:
   int m_active_layer;
   bool m_unsaved;
+  // The title and unsaved status have to be sent with the next frame
+  bool m_current_level_changed;
 
   int m_default_tile_index;
 
@@ -178,7 +215,6 @@ private:
   signal_status_update_type m_signal_status_update;
 
   unsigned int m_position_buffer;
-  unsigned int m_texcoord_buffer;
 
   // Vertex data structures
   struct vertex_position {
@@ -194,7 +230,120 @@ private:
 
   // Store vertices here in case of no VBO support
   std::vector<vertex_position> m_positions;
+
+  // The NPC quads drawn with one texture, kept to reuse their memory
+  struct npc_batch {
+    std::vector<vertex_position> positions;
+    std::vector<vertex_texcoord> tcoords;
+  };
+
+  typedef std::map<unsigned int, npc_batch> npc_batch_list_type;
+  npc_batch_list_type m_npc_batches;
+
+  // Links, signs and selection rectangles
+  ogl_overlay_batch m_overlays;
   bool m_use_vbo;
+
+  // Draws each layer as one quad when available, see setup_buffers
+  ogl_tilemap_shader m_tilemap_shader;
+  bool m_use_tilemap_shader;
+
+  // Levels are rendered into textures through m_framebuffer when supported
+  bool m_use_level_textures;
+  unsigned int m_framebuffer;
+
+  // The drawing data of one level layer, vertices are stored row by row
+  struct layer_cache {
+    layer_cache(): buffer(0), tile_texture(0) {}
+
+    // Texture coordinates in a VBO, or in tcoords without VBO support
+    unsigned int buffer;
+    std::vector<vertex_texcoord> tcoords;
+    // The drawn tiles of each row as (first tile, tile count)
+    std::vector<std::vector<std::pair<int, int> > > row_chunks;
+    // The tiles for m_tilemap_shader, which needs nothing else
+    unsigned int tile_texture;
+  };
+
+  /* Everything draw_tiles needs for a level, kept between frames. Stores
+   * the topmost layer with an opaque tile for every tile (tiles on lower
+   * layers are hidden and skipped) and the texture coordinates of each
+   * layer. Changed rows are rebuilt on the next draw, everything when
+   * anything affecting the drawn layers changes */
+  struct level_cache {
+    level_cache(): level_ptr(0), tileset_generation(0),
+      active_layer(0), fade_layers(false), layer_count(0),
+      dirty_begin(0), dirty_end(0), textured(false) {}
+
+    const level* level_ptr;
+    unsigned int tileset_generation;
+    int active_layer;
+    bool fade_layers;
+    int layer_count;
+    layer_visibility_list_type layer_visibility;
+
+    // Rows to rebuild, from dirty_begin up to dirty_end
+    int dirty_begin, dirty_end;
+
+    // x + y * level width, -1 if no layer is opaque
+    std::vector<short> top_layer;
+    std::vector<layer_cache> layers;
+
+    /* The level rendered into a texture per group of layers: below, at and
+     * above the active layer. Changing a layer only renders the groups up
+     * to it again, and only the changed rows */
+    struct layer_group {
+      layer_group(): texture(0), texture_width(0), texture_height(0),
+        first_layer(0), end_layer(0), dirty_begin(0), dirty_end(0) {}
+
+      unsigned int texture;
+      int texture_width, texture_height;
+      int first_layer, end_layer;
+      // Rows to render again, from dirty_begin up to dirty_end
+      int dirty_begin, dirty_end;
+    };
+
+    static const int group_count = 3;
+    layer_group groups[group_count];
+    // Drawn through the textures in this frame
+    bool textured;
+  };
+
+  typedef std::map<std::pair<int, int>, level_cache> level_cache_list_type;
+  level_cache_list_type m_level_caches;
+  // VBOs and textures of dropped caches, deleted on the next draw when the context is current
+  std::vector<unsigned int> m_unused_buffers;
+  std::vector<unsigned int> m_unused_textures;
+
+  level_cache& get_level_cache(level* current_level, int level_x, int level_y);
+  // Rebuilds rows y up to end_y of the cache
+  void update_level_cache(level_cache& cache, level* current_level, int y, int end_y);
+  // Marks rows of a cached level for rebuilding after a change on the layer
+  void invalidate_level_cache(int level_x, int level_y, int layer, int y, int height);
+  void release_level_cache(level_cache& cache);
+  void release_level_textures(level_cache& cache);
+
+  // A level drawn with one texel per tile when zoomed out far
+  struct level_thumbnail {
+    level_thumbnail(): texture(0), stale(true) {}
+
+    // 0 if there's no level at this position
+    unsigned int texture;
+    // Drawn until it has been made again
+    bool stale;
+  };
+
+  typedef std::map<std::pair<int, int>, level_thumbnail> thumbnail_list_type;
+  thumbnail_list_type m_thumbnails;
+  // What the thumbnails were made with, they all get stale when it changes
+  unsigned int m_thumbnail_tileset_generation;
+  layer_visibility_list_type m_thumbnail_layer_visibility;
+
+  /* Draws the thumbnails of the levels in the range, making missing and
+   * stale ones until the frame's time for it runs out */
+  void draw_thumbnails(int start_x, int start_y, int end_x, int end_y);
+  void update_thumbnail(level_thumbnail& thumbnail, level* current_level);
+  void release_thumbnails();
 };
 
 }
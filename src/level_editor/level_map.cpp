@@ -1,10 +1,14 @@
 #include "level_map.hpp"
+#include "level_registry.hpp"
 #include "filesystem.hpp"
 #include "helper.hpp"
 #include "core/helper.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 using namespace Graal;
 using namespace Graal::level_editor;
@@ -34,6 +38,20 @@ int level_map_source::get_height() const {
   return static_cast<int>(m_level_names.shape()[1]);
 }
 
+bool level_map_source::get_level_path(int, int, boost::filesystem::path&) {
+  return false;
+}
+
+void level_map_source::save_levels(const saved_level_list_type& levels) {
+  saved_level_list_type::const_iterator iter, end = levels.end();
+  for (iter = levels.begin(); iter != end; ++iter)
+    save_level(iter->x, iter->y, iter->level_ptr);
+}
+
+void level_map_source::set_row_store(const boost::shared_ptr<tile_row_store>& store) {
+  m_row_store = store;
+}
+
 /* GMap level source */
 gmap_level_map_source::gmap_level_map_source(filesystem& _filesystem, const boost::filesystem::path& gmap_file_name):
   m_filesystem(_filesystem),
@@ -118,12 +136,17 @@ Graal::level* gmap_level_map_source::load_level(int x, int y) {
   if (!level_name.empty()) {
     boost::filesystem::path level_path;
     if (m_filesystem.get_path(level_name, level_path)) {
-      return load_nw_level(level_path);
+      return load_nw_level(level_path, m_row_store.get());
     }
   }
   return 0;
 }
 
+bool gmap_level_map_source::get_level_path(int x, int y, boost::filesystem::path& path) {
+  std::string level_name = get_level_name(x, y);
+  return !level_name.empty() && m_filesystem.get_path(level_name, path);
+}
+
 void gmap_level_map_source::save_level(int x, int y, level* _level) {
   std::string level_name = get_level_name(x, y);
 
@@ -149,7 +172,15 @@ Graal::level* single_level_map_source::load_level(int x, int y) {
   if (level_name.empty())
     return 0;
 
-  return load_nw_level(level_name);
+  return load_nw_level(level_name, m_row_store.get());
+}
+
+bool single_level_map_source::get_level_path(int x, int y, boost::filesystem::path& path) {
+  std::string level_name = get_level_name(x, y);
+  if (level_name.empty())
+    return false;
+  path = level_name;
+  return true;
 }
 
 void single_level_map_source::save_level(int x, int y, level* _level) {
@@ -159,10 +190,296 @@ void single_level_map_source::save_level(int x, int y, level* _level) {
   }
 }
 
+/* Chunked level source */
+namespace {
+  struct nw_entry {
+    std::streamoff offset;
+    int x, y, width;
+  };
+
+  // Skips the rest of a SIGN or NPC entry
+  void skip_block(std::ifstream& file, const std::string& end_line) {
+    read_line(file);
+    while (!file.eof() && read_line(file) != end_line);
+  }
+
+  inline int to_chunk(int tile, int chunk_size) {
+    return std::max(0, tile) / chunk_size;
+  }
+
+  // Whether the chunk at x, y is marked in replaced, chunks outside of the grid aren't
+  inline bool is_replaced(const std::vector<bool>& replaced, int grid_width, int x, int y) {
+    const std::size_t index = static_cast<std::size_t>(x + y * grid_width);
+    return x < grid_width && index < replaced.size() && replaced[index];
+  }
+
+  // Writes count tiles of a BOARD entry's data, starting with tile first
+  void write_board(std::ostream& stream, int x, int y, int layer,
+                   const std::string& data, int first, int count) {
+    stream << "BOARD " << x + first << " " << y << " " << count << " "
+           << layer << " " << data.substr(first * 2, count * 2) << std::endl;
+  }
+}
+
+chunked_level_map_source::chunked_level_map_source(const boost::filesystem::path& file_name):
+  m_file_name(file_name),
+  m_tiles_width(default_level_size::width),
+  m_tiles_height(default_level_size::height)
+{
+  index_file();
+}
+
+void chunked_level_map_source::index_file() {
+  if (!boost::filesystem::exists(m_file_name))
+    throw std::runtime_error("chunked_level_map_source("+m_file_name.string()+") failed: File not found");
+
+  std::ifstream file(m_file_name.string().c_str());
+
+  std::string version = read_line(file);
+  if (version.find(NW_LEVEL_VERSION) != 0) {
+    throw std::runtime_error("chunked_level_map_source() failed: Version mismatch (" + version + " != " + NW_LEVEL_VERSION + ")");
+  }
+
+  const int chunk_width = default_level_size::width;
+  const int chunk_height = default_level_size::height;
+
+  // Find the extents of all entries first to size the chunk grid
+  std::vector<nw_entry> entries;
+  int width = 1, height = 1;
+  m_tiles_width = chunk_width;
+  m_tiles_height = chunk_height;
+  while (!file.eof()) {
+    nw_entry entry;
+    entry.offset = file.tellg();
+    std::string type = read<std::string>(file);
+
+    if (type == "BOARD") {
+      entry.x = read<int>(file);
+      entry.y = read<int>(file);
+      entry.width = std::max(1, read<int>(file));
+      read_line(file);
+      m_tiles_width = std::max(m_tiles_width, entry.x + entry.width);
+      m_tiles_height = std::max(m_tiles_height, entry.y + 1);
+    } else if (type == "LINK") {
+      read<std::string>(file);
+      entry.x = read<int>(file);
+      entry.y = read<int>(file);
+      entry.width = 1;
+      read_line(file);
+    } else if (type == "SIGN") {
+      entry.x = read<int>(file);
+      entry.y = read<int>(file);
+      entry.width = 1;
+      skip_block(file, "SIGNEND");
+    } else if (type == "NPC") {
+      read<std::string>(file);
+      entry.x = static_cast<int>(read<float>(file));
+      entry.y = static_cast<int>(read<float>(file));
+      entry.width = 1;
+      skip_block(file, "NPCEND");
+    } else {
+      read_line(file);
+      continue;
+    }
+
+    width = std::max(width, to_chunk(entry.x + entry.width - 1, chunk_width) + 1);
+    height = std::max(height, to_chunk(entry.y, chunk_height) + 1);
+    entries.push_back(entry);
+  }
+
+  level_names_list_type::extent_gen extend;
+  m_level_names.resize(extend[width][height]);
+  std::fill(m_level_names.data(), m_level_names.data() + m_level_names.num_elements(),
+            m_file_name.string());
+
+  m_chunk_entries.clear();
+  m_chunk_entries.resize(width * height);
+
+  // A BOARD row spanning multiple chunks gets read by each of them
+  std::vector<nw_entry>::const_iterator iter, end = entries.end();
+  for (iter = entries.begin(); iter != end; ++iter) {
+    const int chunk_y = to_chunk(iter->y, chunk_height);
+    const int last_x = to_chunk(iter->x + iter->width - 1, chunk_width);
+    for (int chunk_x = to_chunk(iter->x, chunk_width); chunk_x <= last_x; ++chunk_x)
+      m_chunk_entries[chunk_x + chunk_y * width].push_back(iter->offset);
+  }
+}
+
+Graal::level* chunked_level_map_source::load_level(int x, int y) {
+  if (x < 0 || y < 0 || x >= get_width() || y >= get_height())
+    return 0;
+
+  std::ifstream file(m_file_name.string().c_str());
+
+  Graal::level* level = new Graal::level();
+
+  // Clear the tiles past the end of the level
+  const int level_width = m_tiles_width - x * default_level_size::width;
+  const int level_height = m_tiles_height - y * default_level_size::height;
+  if (level_width < level->get_width() || level_height < level->get_height()) {
+    Graal::tile_buf& tiles = level->get_tiles(0);
+    for (int tile_y = 0; tile_y < level->get_height(); ++tile_y) {
+      const int first = tile_y < level_height ? level_width : 0;
+      if (first >= level->get_width())
+        continue;
+      Graal::tile* row = tiles.get_row(tile_y);
+      std::fill(row + first, row + level->get_width(), Graal::tile_transparent);
+    }
+  }
+
+  const entry_list_type& chunk_entries = m_chunk_entries[x + y * get_width()];
+  entry_list_type::const_iterator iter, end = chunk_entries.end();
+  for (iter = chunk_entries.begin(); iter != end; ++iter) {
+    file.seekg(*iter);
+    std::string type = read<std::string>(file);
+    read_nw_entry(file, type, level,
+      x * default_level_size::width, y * default_level_size::height,
+      m_row_store.get());
+  }
+
+  if (m_row_store) {
+    for (int layer = 0; layer < level->get_layer_count(); ++layer)
+      level->get_tiles(layer).intern_rows(*m_row_store);
+  }
+
+  return level;
+}
+
+bool chunked_level_map_source::get_level_path(int x, int y, boost::filesystem::path& path) {
+  if (get_width() != 1 || get_height() != 1)
+    return false;
+  const std::string level_name = get_level_name(x, y);
+  if (level_name.empty())
+    return false;
+  path = level_name;
+  return true;
+}
+
+void chunked_level_map_source::save_level(int x, int y, level* _level) {
+  save_levels(saved_level_list_type(1, saved_level(x, y, _level)));
+}
+
+void chunked_level_map_source::save_levels(const saved_level_list_type& levels) {
+  if (levels.empty())
+    return;
+  const std::string level_name = get_level_name(levels.front().x, levels.front().y);
+  if (level_name.empty())
+    return;
+
+  const int chunk_width = default_level_size::width;
+  const int chunk_height = default_level_size::height;
+  const int grid_width = get_width();
+
+  std::vector<bool> replaced(m_chunk_entries.size(), false);
+  saved_level_list_type::const_iterator level_iter, level_end = levels.end();
+  for (level_iter = levels.begin(); level_iter != level_end; ++level_iter)
+    replaced[level_iter->x + level_iter->y * grid_width] = true;
+
+  // Keep everything outside of the chunks, the file might be rewritten in place
+  std::ostringstream stream;
+  {
+    std::ifstream file(m_file_name.string().c_str());
+    stream << read_line(file) << std::endl;
+
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream entry(line);
+      std::string type;
+      entry >> type;
+
+      if (type == "BOARD") {
+        int start_x, start_y, width, layer; std::string data;
+        entry >> start_x >> start_y >> width >> layer >> data;
+        width = std::min(width, static_cast<int>(data.size()) / 2);
+
+        // Split off the parts of the row outside of the chunks
+        const int chunk_y = to_chunk(start_y, chunk_height);
+        bool split = false;
+        int kept = 0;
+        for (int i = 0; i < width;) {
+          const int chunk_x = to_chunk(start_x + i, chunk_width);
+          const int next = std::min(width, (chunk_x + 1) * chunk_width - start_x);
+          if (is_replaced(replaced, grid_width, chunk_x, chunk_y)) {
+            if (kept < i)
+              write_board(stream, start_x, start_y, layer, data, kept, i - kept);
+            kept = next;
+            split = true;
+          }
+          i = next;
+        }
+
+        if (!split)
+          stream << line << std::endl;
+        else if (kept < width)
+          write_board(stream, start_x, start_y, layer, data, kept, width - kept);
+        continue;
+      }
+
+      float entry_x, entry_y;
+      if (type == "LINK") {
+        std::string destination;
+        entry >> destination;
+      } else if (type == "NPC") {
+        std::string image;
+        entry >> image;
+      } else if (type != "SIGN") {
+        stream << line << std::endl;
+        continue;
+      }
+      entry >> entry_x >> entry_y;
+
+      // Objects belong to the chunk of their origin
+      const bool in_chunk = is_replaced(replaced, grid_width,
+        to_chunk(static_cast<int>(entry_x), chunk_width),
+        to_chunk(static_cast<int>(entry_y), chunk_height));
+      const std::string end_line =
+        type == "SIGN" ? "SIGNEND" : type == "NPC" ? "NPCEND" : "";
+
+      if (!in_chunk)
+        stream << line << std::endl;
+      if (end_line.empty())
+        continue;
+
+      while (std::getline(file, line)) {
+        if (!in_chunk)
+          stream << line << std::endl;
+        if (line == end_line)
+          break;
+      }
+    }
+  }
+
+  for (level_iter = levels.begin(); level_iter != level_end; ++level_iter) {
+    write_nw_entries(stream, level_iter->level_ptr,
+      level_iter->x * chunk_width, level_iter->y * chunk_height);
+  }
+
+  // Saving to another name moves the whole level
+  if (level_name != m_file_name.string()) {
+    m_file_name = level_name;
+    std::fill(m_level_names.data(), m_level_names.data() + m_level_names.num_elements(),
+              level_name);
+  }
+
+  {
+    std::ofstream file(m_file_name.string().c_str());
+    file << stream.str();
+  }
+
+  // Entry offsets changed, the chunk grid might have grown
+  index_file();
+}
+
 /* level map */
 level_map::level_map():
   m_level_width(0),
-  m_level_height(0)
+  m_level_height(0),
+  m_default_level_size(false),
+  m_width(0),
+  m_height(0),
+  m_access_counter(0),
+  m_max_loaded_levels(64),
+  m_edit_depth(0)
 {
   /* TODO: not sure where else to set this, it's Graal specific and not
    * mentioned in any level file or GMap. For what it's worth, levels could
@@ -170,8 +487,22 @@ level_map::level_map():
   set_level_size(64, 64); 
 }
 
+level_map::~level_map() {
+  m_registry_connection.disconnect();
+}
+
+void level_map::set_level_registry(const boost::shared_ptr<level_registry>& registry) {
+  m_registry_connection.disconnect();
+  m_registry = registry;
+  if (m_registry) {
+    m_registry_connection = m_registry->signal_changed().connect(
+      sigc::mem_fun(*this, &level_map::on_registry_changed));
+  }
+}
+
 void level_map::set_level_source(const boost::shared_ptr<level_map_source>& source) {
   m_level_source = source;
+  m_level_source->set_row_store(m_row_store);
   set_size(source->get_width(), source->get_height());
 }
 
@@ -180,7 +511,7 @@ const boost::shared_ptr<level_map_source>& level_map::get_level_source() {
 }
 
 const boost::shared_ptr<level>& level_map::load_level(const boost::filesystem::path& _file_name, int x, int y) {
-  level* new_level = load_nw_level(_file_name);
+  level* new_level = load_nw_level(_file_name, m_row_store.get());
 
   set_level(new_level, x, y);
 
@@ -206,58 +537,251 @@ void level_map::set_level(level* _level, int x, int y) {
 
   /* Store and take ownership of the passed level, overwriting any possibly
    * already loaded levels */
-  m_level_list[x][y].reset(_level);
+  level_entry& entry = m_level_list[std::make_pair(x, y)];
+  entry.level_ptr.reset(_level);
+  entry.last_used = ++m_access_counter;
+  entry.saved_hash = _level->get_content_hash();
 }
 
 const boost::shared_ptr<level>& level_map::get_level(int x, int y) {
   // FIXME: this requires a static destructor, gross
   static const boost::shared_ptr<level> no_level;
   // Fail silently
-  if (x >= get_width() || y >= get_height())
+  if (x < 0 || y < 0 || x >= get_width() || y >= get_height())
     return no_level;
 
-  boost::shared_ptr<level>& level_ptr = m_level_list[x][y];
-  // Load the level if it is not loaded and we have a source to look up into
-  if (m_level_source && !level_ptr) {
-    level* new_level = m_level_source->load_level(x, y);
-    if (new_level) {
-      level_ptr.reset(new_level);
+  const std::pair<int, int> key(x, y);
+  level_list_type::iterator iter = m_level_list.find(key);
+  if (iter == m_level_list.end()) {
+    // Load the level if it is not loaded and we have a source to look up into
+    if (!m_level_source)
+      return no_level;
+
+    // Use the instance other level maps loaded from the same file
+    boost::filesystem::path level_path;
+    boost::shared_ptr<level> shared_level;
+    boost::uint64_t saved_hash = 0;
+    const bool shared = m_registry && m_level_source->get_level_path(x, y, level_path);
+    if (shared)
+      shared_level = m_registry->find(level_path, saved_hash);
+
+    if (!shared_level) {
+      level* new_level = m_level_source->load_level(x, y);
+      if (!new_level)
+        return no_level;
+      shared_level.reset(new_level);
+      saved_hash = new_level->get_content_hash();
+      if (shared)
+        m_registry->add(level_path, shared_level, saved_hash);
     }
+
+    iter = m_level_list.insert(std::make_pair(key, level_entry())).first;
+    iter->second.level_ptr = shared_level;
+    iter->second.saved_hash = saved_hash;
+    if (shared)
+      iter->second.shared_path = level_path;
   }
 
-  return level_ptr;
+  if (iter->second.compressed)
+    expand_level(iter->second);
+
+  iter->second.last_used = ++m_access_counter;
+  return iter->second.level_ptr;
 }
 
 level_map::level_list_type& level_map::get_levels() {
   return m_level_list;
 }
 
-tile& level_map::get_tile_editable(int x, int y, int layer) {
-  const int level_width = get_level_width();
-  const int level_height = get_level_height();
+level_map::snapshot_type level_map::snapshot() const {
+  snapshot_type result;
+  level_list_type::const_iterator iter, end = m_level_list.end();
+  for (iter = m_level_list.begin(); iter != end; ++iter) {
+    if (!iter->second.level_ptr)
+      continue;
+
+    if (iter->second.compressed) {
+      // Expand a copy, snapshots don't count as using the level
+      level* expanded_level = new level(*iter->second.level_ptr);
+      for (std::size_t layer = 0; layer < iter->second.compressed_layers.size(); ++layer)
+        iter->second.compressed_layers[layer].decompress(expanded_level->get_tiles(static_cast<int>(layer)));
+      result.insert(result.end(), snapshot_type::value_type(iter->first, level_snapshot(expanded_level)));
+    } else {
+      result.insert(result.end(), snapshot_type::value_type(iter->first, snapshot_level(*iter->second.level_ptr)));
+    }
+  }
+  return result;
+}
 
-  // The particular level this tile falls in
-  const int level_x = x / level_width;
-  const int level_y = y / level_height;
+void level_map::set_level_modified(int x, int y, bool modified) {
+  level_list_type::iterator iter = m_level_list.find(std::make_pair(x, y));
+  if (iter != m_level_list.end())
+    iter->second.modified = modified;
+}
 
-  // The actual tile position inside the level
-  const int tile_x = x % level_width;
-  const int tile_y = y % level_height;
+bool level_map::is_level_modified(int x, int y) const {
+  level_list_type::const_iterator iter = m_level_list.find(std::make_pair(x, y));
+  return iter != m_level_list.end() && iter->second.modified;
+}
+
+bool level_map::is_level_changed(int x, int y) {
+  level_list_type::iterator iter = m_level_list.find(std::make_pair(x, y));
+  if (iter == m_level_list.end() || !iter->second.level_ptr)
+    return false;
+
+  // Another level map might have saved a shared level since
+  if (m_registry && !iter->second.shared_path.empty())
+    m_registry->find(iter->second.shared_path, iter->second.saved_hash);
+  return iter->second.level_ptr->get_content_hash() != iter->second.saved_hash;
+}
+
+void level_map::mark_level_saved(int x, int y) {
+  level_list_type::iterator iter = m_level_list.find(std::make_pair(x, y));
+  if (iter == m_level_list.end() || !iter->second.level_ptr)
+    return;
+
+  iter->second.saved_hash = iter->second.level_ptr->get_content_hash();
+  if (m_registry && !iter->second.shared_path.empty())
+    m_registry->set_saved_hash(iter->second.shared_path, iter->second.saved_hash);
+}
+
+std::size_t level_map::get_max_loaded_levels() const {
+  return m_max_loaded_levels;
+}
+
+void level_map::set_max_loaded_levels(std::size_t max_levels) {
+  m_max_loaded_levels = max_levels;
+}
+
+std::size_t level_map::get_loaded_level_count() const {
+  return m_level_list.size();
+}
+
+void level_map::set_intern_rows(bool intern) {
+  if (intern == get_intern_rows())
+    return;
+
+  if (intern)
+    m_row_store.reset(new tile_row_store());
+  else
+    m_row_store.reset();
+
+  if (m_level_source)
+    m_level_source->set_row_store(m_row_store);
+}
+
+bool level_map::get_intern_rows() const {
+  return m_row_store.get() != 0;
+}
+
+namespace {
+  typedef std::pair<unsigned long, level_map::level_list_type::iterator> eviction_candidate;
+
+  bool least_recently_used(const eviction_candidate& a, const eviction_candidate& b) {
+    return a.first < b.first;
+  }
+}
+
+void level_map::evict_levels() {
+  if (m_level_list.size() <= m_max_loaded_levels)
+    return;
+
+  std::vector<eviction_candidate> candidates;
+  std::vector<eviction_candidate> compress_candidates;
+  std::size_t compressed_count = 0;
+  level_list_type::iterator iter, end = m_level_list.end();
+  for (iter = m_level_list.begin(); iter != end; ++iter) {
+    const level_entry& entry = iter->second;
+    if (entry.compressed) {
+      ++compressed_count;
+      continue;
+    }
+    // Only drop levels we can get back in the same state
+    if (!entry.level_ptr.unique())
+      continue;
+    if (entry.modified) {
+      compress_candidates.push_back(eviction_candidate(entry.last_used, iter));
+      continue;
+    }
+    if (!m_level_source || m_level_source->get_level_name(iter->first.first, iter->first.second).empty())
+      continue;
+
+    candidates.push_back(eviction_candidate(entry.last_used, iter));
+  }
+
+  std::sort(candidates.begin(), candidates.end(), least_recently_used);
+
+  std::vector<eviction_candidate>::iterator candidate, candidates_end = candidates.end();
+  for (candidate = candidates.begin();
+       candidate != candidates_end && m_level_list.size() > m_max_loaded_levels;
+       ++candidate) {
+    m_level_list.erase(candidate->second);
+  }
+
+  // Modified levels have to stay, but only need their tiles when used
+  std::sort(compress_candidates.begin(), compress_candidates.end(), least_recently_used);
+
+  candidates_end = compress_candidates.end();
+  for (candidate = compress_candidates.begin();
+       candidate != candidates_end && m_level_list.size() - compressed_count > m_max_loaded_levels;
+       ++candidate) {
+    compress_level(candidate->second->second);
+    ++compressed_count;
+  }
+}
+
+std::size_t level_map::get_compressed_level_count() const {
+  std::size_t count = 0;
+  level_list_type::const_iterator iter, end = m_level_list.end();
+  for (iter = m_level_list.begin(); iter != end; ++iter) {
+    if (iter->second.compressed)
+      ++count;
+  }
+  return count;
+}
+
+void level_map::compress_level(level_entry& entry) {
+  level& compressed_level = *entry.level_ptr;
+  const int layer_count = compressed_level.get_layer_count();
+  entry.compressed_layers.resize(static_cast<std::size_t>(layer_count));
+  for (int layer = 0; layer < layer_count; ++layer) {
+    entry.compressed_layers[layer] = compressed_tile_buf(compressed_level.get_tiles(layer));
+    compressed_level.get_tiles(layer).clear();
+  }
+  entry.compressed = true;
+}
+
+void level_map::expand_level(level_entry& entry) {
+  level& expanded_level = *entry.level_ptr;
+  const int layer_count = static_cast<int>(entry.compressed_layers.size());
+  for (int layer = 0; layer < layer_count; ++layer)
+    entry.compressed_layers[layer].decompress(expanded_level.get_tiles(layer), m_row_store.get());
+  entry.compressed_layers.clear();
+  entry.compressed = false;
+}
 
-  //std::cout << "Get tile " << x << "," << y << ": " << tile_x << "," << tile_y << " level: " << level_x << "," << level_y << std::endl;
-  level* tile_level = get_level(level_x, level_y).get();
+tile_buf& level_map::get_level_tiles(int x, int y, int layer) {
+  // The particular level this tile falls in
+  level* tile_level = get_level(to_level_x(x), to_level_y(y)).get();
   if (tile_level) {
     // Ensure that the layer exists
-    return tile_level->create_tiles(layer).get_tile(tile_x, tile_y);
+    return tile_level->create_tiles(layer);
   }
 
   throw std::runtime_error("Attempted to edit a tile outside the map");
 }
 
+tile& level_map::get_tile_editable(int x, int y, int layer) {
+  // The actual tile position inside the level
+  return get_level_tiles(x, y, layer).get_tile(to_tile_x(x), to_tile_y(y));
+}
+
 const tile& level_map::get_tile(int x, int y, int layer) {
   // Gracefully handle exceptions here and just return an invalid tile
   try {
-    return get_tile_editable(x, y, layer);
+    // Read through a const tile_buf so shared rows aren't copied
+    const tile_buf& tiles = get_level_tiles(x, y, layer);
+    return tiles.get_tile(to_tile_x(x), to_tile_y(y));
   } catch (const std::exception& e) {
     std::cout << "Error reading tile ( " << x << "," << y << "): " << e.what() << std::endl;
     return tile_invalid;
@@ -267,14 +791,7 @@ const tile& level_map::get_tile(int x, int y, int layer) {
 void level_map::set_tile(const tile& tile, int x, int y, int layer) {
   get_tile_editable(x, y, layer) = tile;
 
-  const int level_width = get_level_width();
-  const int level_height = get_level_height();
-
-  // The particular level this tile falls in
-  const int level_x = x / level_width;
-  const int level_y = y / level_height;
-
-  m_signal_level_changed(level_x, level_y);
+  mark_dirty(to_level_x(x), to_level_y(y), layer, to_tile_x(x), to_tile_y(y), 1, 1);
 }
 
 bool level_map::is_valid_tile(int x, int y) {
@@ -282,14 +799,8 @@ bool level_map::is_valid_tile(int x, int y) {
 }
 
 level::npc_list_type& level_map::get_npcs(int x, int y) {
-  const int level_width = get_level_width();
-  const int level_height = get_level_height();
-
   // The particular level this tile falls in
-  const int level_x = x / level_width;
-  const int level_y = y / level_height;
-
-  level* tile_level = get_level(level_x, level_y).get();
+  level* tile_level = get_level(to_level_x(x), to_level_y(y)).get();
   if (tile_level) {
     return tile_level->npcs;
   }
@@ -310,6 +821,14 @@ void level_map::delete_npc(const level_map::npc_ref& ref) {
     npc_level->delete_npc(ref.id);
 }
 
+void level_map::update_npc(const level_map::npc_ref& ref, const npc& new_npc) {
+  level* npc_level = get_level(ref.level_x, ref.level_y).get();
+  if (npc_level) {
+    npc_level->update_npc(npc_level->get_npc(ref.id), new_npc);
+    mark_level_changed(ref.level_x, ref.level_y);
+  }
+}
+
 npc* level_map::move_npc(level_map::npc_ref& ref, float new_x, float new_y) {
   const int level_width = get_level_width();
   const int level_height = get_level_height();
@@ -321,33 +840,32 @@ npc* level_map::move_npc(level_map::npc_ref& ref, float new_x, float new_y) {
   const float new_tiles_x = new_x - new_level_x * get_level_width();
   const float new_tiles_y = new_y - new_level_y * get_level_height();
 
-  npc* _npc = get_npc(ref);
-  npc* new_npc = _npc;
+  npc* new_npc = get_npc(ref);
+  level* new_level = get_level(new_level_x, new_level_y).get();
 
   // The level changed, take care of moving the NPC into the new level
   if (new_level_x != ref.level_x || new_level_y != ref.level_y) {
     level* old_level = get_level(ref.level_x, ref.level_y).get();
-    level* new_level = get_level(new_level_x, new_level_y).get();
 
-    // Add a copy of the old NPC
-    new_npc = &new_level->add_npc(*_npc);
-    old_level->delete_npc(_npc->id);
+    Graal::npc moved_npc;
+    old_level->take_npc(ref.id, moved_npc);
+    new_npc = &new_level->add_npc(boost::move(moved_npc));
+    mark_level_changed(ref.level_x, ref.level_y);
 
     // Fix reference
     ref.id = new_npc->id;
     ref.level_x = new_level_x;
     ref.level_y = new_level_y;
-
-    m_signal_level_changed(ref.level_x, ref.level_y);
   }
-  
-  m_signal_level_changed(new_level_x, new_level_y);
 
   // Set the correct position inside the level
+  new_level->unhash_object(*new_npc);
   new_npc->set_level_x(new_tiles_x);
   new_npc->set_level_y(new_tiles_y);
+  new_level->hash_object(*new_npc);
+
+  mark_level_changed(new_level_x, new_level_y);
 
-  
   return new_npc;
 }
 
@@ -358,11 +876,11 @@ void level_map::get_global_npc_position(const level_map::npc_ref& ref, float& x,
 }
 
 int level_map::get_width() const {
-  return static_cast<int>(m_level_list.shape()[0]);
+  return m_width;
 }
 
 int level_map::get_height() const {
-  return static_cast<int>(m_level_list.shape()[1]);
+  return m_height;
 }
 
 int level_map::get_width_tiles() const {
@@ -374,8 +892,17 @@ int level_map::get_height_tiles() const {
 }
 
 void level_map::set_size(int width, int height) {
-  level_list_type::extent_gen extents;
-  m_level_list.resize(extents[width][height]);
+  m_width = width;
+  m_height = height;
+
+  // Drop levels outside the new bounds
+  level_list_type::iterator iter = m_level_list.begin();
+  while (iter != m_level_list.end()) {
+    if (iter->first.first >= width || iter->first.second >= height)
+      m_level_list.erase(iter++);
+    else
+      ++iter;
+  }
 }
 
 int level_map::get_level_width() const {
@@ -389,6 +916,8 @@ int level_map::get_level_height() const {
 void level_map::set_level_size(int width, int height) {
   m_level_width = width;
   m_level_height = height;
+  m_default_level_size = width == default_level_size::width
+                      && height == default_level_size::height;
 }
 
 level_map* level_map::load_from_gmap(filesystem& _filesystem, const boost::filesystem::path& _file_name) {
@@ -404,3 +933,268 @@ level_map* level_map::load_from_gmap(filesystem& _filesystem, const boost::files
 level_map::signal_level_changed_type& level_map::signal_level_changed() {
   return m_signal_level_changed;
 }
+
+level_map::signal_dirty_rects_type& level_map::signal_dirty_rects() {
+  return m_signal_dirty_rects;
+}
+
+void level_map::mark_dirty(int level_x, int level_y, int layer, int x, int y, int width, int height) {
+  if (width <= 0 || height <= 0)
+    return;
+
+  dirty_rect_map_type::key_type key(std::make_pair(level_x, level_y), layer);
+  dirty_rect_map_type::iterator iter = m_dirty_rects.find(key);
+
+  if (iter == m_dirty_rects.end()) {
+    dirty_rect rect;
+    rect.level_x = level_x;
+    rect.level_y = level_y;
+    rect.layer = layer;
+    rect.x = x; rect.y = y;
+    rect.width = width; rect.height = height;
+    m_dirty_rects[key] = rect;
+  } else {
+    // Grow the existing rectangle to cover the new one
+    dirty_rect& rect = iter->second;
+    const int x2 = std::max(rect.x + rect.width, x + width);
+    const int y2 = std::max(rect.y + rect.height, y + height);
+    rect.x = std::min(rect.x, x);
+    rect.y = std::min(rect.y, y);
+    rect.width = x2 - rect.x;
+    rect.height = y2 - rect.y;
+  }
+
+  if (m_edit_depth == 0)
+    flush_changes();
+}
+
+void level_map::mark_level_changed(int level_x, int level_y) {
+  mark_dirty(level_x, level_y, -1, 0, 0, get_level_width(), get_level_height());
+}
+
+void level_map::flush_changes() {
+  if (m_dirty_rects.empty())
+    return;
+
+  // Take the changes first, handlers might make further changes
+  dirty_rect_list_type rects;
+  rects.reserve(m_dirty_rects.size());
+  dirty_rect_map_type::iterator iter, end = m_dirty_rects.end();
+  for (iter = m_dirty_rects.begin(); iter != end; ++iter) {
+    rects.push_back(iter->second);
+  }
+  m_dirty_rects.clear();
+
+  // Keep the content hashes up to date before anyone compares them
+  shared_change_list_type shared_changes;
+  level_list_type::iterator level_iter;
+  for (std::size_t i = 0; i < rects.size(); ++i) {
+    level_iter = m_level_list.find(std::make_pair(rects[i].level_x, rects[i].level_y));
+    if (level_iter == m_level_list.end() || !level_iter->second.level_ptr)
+      continue;
+    // Objects update the hash themselves when they are changed
+    if (rects[i].layer >= 0)
+      level_iter->second.level_ptr->update_tiles_hash(rects[i].layer, rects[i].y, rects[i].height);
+
+    if (!level_iter->second.shared_path.empty()) {
+      shared_change change;
+      change.changed_level = level_iter->second.level_ptr.get();
+      change.rect = rects[i];
+      shared_changes.push_back(change);
+    }
+  }
+
+  emit_changes(rects);
+
+  if (m_registry)
+    m_registry->notify_changed(this, shared_changes);
+}
+
+void level_map::emit_changes(const dirty_rect_list_type& rects) {
+  // The rects are ordered by level first, so equal levels are adjacent
+  for (std::size_t i = 0; i < rects.size(); ++i) {
+    if (i > 0 && rects[i].level_x == rects[i - 1].level_x
+              && rects[i].level_y == rects[i - 1].level_y)
+      continue;
+    m_signal_level_changed(rects[i].level_x, rects[i].level_y);
+  }
+
+  m_signal_dirty_rects(rects);
+}
+
+void level_map::on_registry_changed(const level_map* sender, const shared_change_list_type& changes) {
+  if (sender == this)
+    return;
+
+  // Find where the changed levels are in this map, if they are at all
+  dirty_rect_list_type rects;
+  shared_change_list_type::const_iterator iter, end = changes.end();
+  for (iter = changes.begin(); iter != end; ++iter) {
+    level_list_type::const_iterator level_iter, level_end = m_level_list.end();
+    for (level_iter = m_level_list.begin(); level_iter != level_end; ++level_iter) {
+      if (level_iter->second.level_ptr.get() != iter->changed_level)
+        continue;
+      dirty_rect rect = iter->rect;
+      rect.level_x = level_iter->first.first;
+      rect.level_y = level_iter->first.second;
+      rects.push_back(rect);
+    }
+  }
+
+  if (!rects.empty())
+    emit_changes(rects);
+}
+
+/* edit scope */
+level_map::edit_scope::edit_scope(level_map& map):
+  m_map(map)
+{
+  ++m_map.m_edit_depth;
+}
+
+level_map::edit_scope::~edit_scope() {
+  if (--m_map.m_edit_depth == 0)
+    m_map.flush_changes();
+}
+
+/* tile region */
+level_map::tile_region::tile_region(level_map& map, int x, int y, int width, int height, int layer, bool writable):
+  m_map(map),
+  m_scope(map),
+  m_x(x), m_y(y), m_width(width), m_height(height),
+  m_layer(layer),
+  m_writable(writable),
+  m_buf(0),
+  m_row(0), m_first_row(0), m_end_row(0),
+  m_span_x(0), m_span_width(0)
+{
+  const int level_width = map.get_level_width();
+  const int level_height = map.get_level_height();
+
+  // Clip the region to the map
+  const int x1 = std::max(0, x);
+  const int y1 = std::max(0, y);
+  const int x2 = std::min(map.get_width_tiles(), x + width);
+  const int y2 = std::min(map.get_height_tiles(), y + height);
+
+  if (x1 >= x2 || y1 >= y2) {
+    // Nothing to walk, next() fails right away
+    m_first_level_x = m_last_level_x = m_last_level_y = -1;
+    m_level_x = 0;
+    m_level_y = 0;
+    return;
+  }
+
+  m_first_level_x = x1 / level_width;
+  m_last_level_x = (x2 - 1) / level_width;
+  m_last_level_y = (y2 - 1) / level_height;
+
+  // Start right before the first level, next_level() advances into it
+  m_level_x = m_first_level_x - 1;
+  m_level_y = y1 / level_height;
+}
+
+level_map::tile_region::~tile_region() {
+  finish_level();
+}
+
+bool level_map::tile_region::next() {
+  if (m_buf && ++m_row < m_end_row)
+    return true;
+
+  return next_level();
+}
+
+bool level_map::tile_region::next_level() {
+  finish_level();
+
+  const int level_width = m_map.get_level_width();
+  const int level_height = m_map.get_level_height();
+
+  while (m_level_y <= m_last_level_y) {
+    if (++m_level_x > m_last_level_x) {
+      m_level_x = m_first_level_x;
+      if (++m_level_y > m_last_level_y)
+        break;
+    }
+
+    level* current_level = m_map.get_level(m_level_x, m_level_y).get();
+    if (!current_level)
+      continue;
+
+    m_buf = &current_level->create_tiles(m_layer);
+
+    // The part of the region inside this level, in level coordinates
+    const int origin_x = m_level_x * level_width;
+    const int origin_y = m_level_y * level_height;
+    m_span_x = std::max(m_x, origin_x) - origin_x;
+    m_span_width = std::min(m_x + m_width, std::min(origin_x + level_width, m_map.get_width_tiles())) - origin_x - m_span_x;
+    m_row = m_first_row = std::max(m_y, origin_y) - origin_y;
+    m_end_row = std::min(m_y + m_height, std::min(origin_y + level_height, m_map.get_height_tiles())) - origin_y;
+
+    return true;
+  }
+
+  m_buf = 0;
+  return false;
+}
+
+void level_map::tile_region::finish_level() {
+  if (m_buf && m_writable) {
+    m_map.mark_dirty(m_level_x, m_level_y, m_layer,
+      m_span_x, m_first_row, m_span_width, m_end_row - m_first_row);
+  }
+  m_buf = 0;
+}
+
+/* tile accessor */
+level_map::tile_accessor::tile_accessor(level_map& map, int layer):
+  m_map(map),
+  m_scope(map),
+  m_layer(layer),
+  m_level_x(-1), m_level_y(-1),
+  m_buf(0)
+{
+}
+
+level_map::tile_accessor::~tile_accessor() {
+}
+
+const tile* level_map::tile_accessor::get_tile(int x, int y) {
+  if (!find_level(x, y))
+    return 0;
+
+  // Read through a const tile_buf so shared rows aren't copied
+  const tile_buf* tiles = m_buf;
+  return &tiles->get_tile(m_map.to_tile_x(x), m_map.to_tile_y(y));
+}
+
+bool level_map::tile_accessor::set_tile(const tile& _tile, int x, int y) {
+  if (!find_level(x, y))
+    return false;
+
+  const int tile_x = m_map.to_tile_x(x);
+  const int tile_y = m_map.to_tile_y(y);
+
+  m_buf->get_tile(tile_x, tile_y) = _tile;
+  m_map.mark_dirty(m_level_x, m_level_y, m_layer, tile_x, tile_y, 1, 1);
+  return true;
+}
+
+bool level_map::tile_accessor::find_level(int x, int y) {
+  if (x < 0 || y < 0 || x >= m_map.get_width_tiles() || y >= m_map.get_height_tiles())
+    return false;
+
+  const int level_x = m_map.to_level_x(x);
+  const int level_y = m_map.to_level_y(y);
+
+  if (level_x != m_level_x || level_y != m_level_y) {
+    m_level_x = level_x;
+    m_level_y = level_y;
+
+    level* current_level = m_map.get_level(level_x, level_y).get();
+    m_buf = current_level ? &current_level->create_tiles(m_layer) : 0;
+  }
+
+  return m_buf != 0;
+}
@@ -5,12 +5,15 @@
 #include <boost/multi_array.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/filesystem/path.hpp>
+#include <map>
+#include <vector>
 
 namespace Graal {
 
 namespace level_editor {
 
 class filesystem;
+class level_registry;
 
 /* TODO: Needs cleaning up, determine what needs to be in the base class,
  * and what should go into derived classes. Also think about whether the
@@ -29,13 +32,37 @@ public:
   void set_level_name(int x, int y, const std::string& name);
   /* Reads the level name at the passed position and loads it */
   virtual level* load_level(int x, int y) = 0;
+  /* Returns the file the level at the passed position is loaded from, if
+   * the level is a file of its own */
+  virtual bool get_level_path(int x, int y, boost::filesystem::path& path);
   /* Saves the level at the specified position */
   virtual void save_level(int x, int y, level* _level) = 0;
 
+  struct saved_level {
+    saved_level(int _x, int _y, level* _level): x(_x), y(_y), level_ptr(_level) {}
+
+    int x, y;
+    level* level_ptr;
+  };
+  typedef std::vector<saved_level> saved_level_list_type;
+
+  /* Saves all passed levels, one after another unless the source can do
+   * better */
+  virtual void save_levels(const saved_level_list_type& levels);
+
   int get_width() const;
   int get_height() const;
+
+  /* Sets the store loaded levels intern their tile rows into, an empty
+   * pointer disables interning */
+  void set_row_store(const boost::shared_ptr<tile_row_store>& store);
+
+  /* Whether all positions are backed by the same file, saving any of them
+   * then needs to save all of them */
+  virtual bool is_single_file() const { return false; }
 protected:
   level_names_list_type m_level_names;
+  boost::shared_ptr<tile_row_store> m_row_store;
 };
 
 /* A map source representing a single level */
@@ -44,15 +71,49 @@ public:
   single_level_map_source(const boost::filesystem::path& file_name);
 
   virtual level* load_level(int x, int y);
+  virtual bool get_level_path(int x, int y, boost::filesystem::path& path);
   virtual void save_level(int x, int y, level* _level);
 };
 
+/* A map source splitting a single level of any size into chunks of
+ * default_level_size tiles. The file is indexed once, loading a chunk
+ * then only reads the entries overlapping it. Levels of the default size
+ * are a single chunk.
+ *
+ * Tiles of the edge chunks past the size of the level are transparent,
+ * so they are neither drawn nor written back */
+class chunked_level_map_source: public level_map_source {
+public:
+  chunked_level_map_source(const boost::filesystem::path& file_name);
+
+  virtual level* load_level(int x, int y);
+  /* The file is the level's own file if it is a single chunk */
+  virtual bool get_level_path(int x, int y, boost::filesystem::path& path);
+  /* Rewrites the file with the entries of the passed chunk replaced */
+  virtual void save_level(int x, int y, level* _level);
+  /* Rewrites the file once with the entries of all passed chunks replaced */
+  virtual void save_levels(const saved_level_list_type& levels);
+
+  virtual bool is_single_file() const { return true; }
+protected:
+  typedef std::vector<std::streamoff> entry_list_type;
+
+  void index_file();
+
+  boost::filesystem::path m_file_name;
+  // Offsets of the entries overlapping each chunk, indexed by x + y * width
+  std::vector<entry_list_type> m_chunk_entries;
+  // Size of the level in tiles, at least the default level size
+  int m_tiles_width, m_tiles_height;
+};
+
 /* A map source retrieving its level names from a GMap */
 class gmap_level_map_source: public level_map_source {
 public:
   gmap_level_map_source(filesystem& _filesystem, const boost::filesystem::path& gmap_file_name);
 
   virtual level* load_level(int x, int y);
+  virtual bool get_level_path(int x, int y, boost::filesystem::path& path);
   virtual void save_level(int x, int y, level* _level);
 protected:
   filesystem& m_filesystem;
@@ -60,7 +121,10 @@ protected:
 };
 
 /* Contains multiple levels and provides helpful functions for accessing them.
- * Dynamically loads requested levels from an input level name list
+ * Dynamically loads requested levels from an input level name list.
+ * Only loaded levels are stored. Once more than get_max_loaded_levels()
+ * levels are loaded, evict_levels() drops the least recently used levels
+ * that are not modified, they get reloaded from the level source on demand.
  */
 class level_map: boost::noncopyable {
 public:
@@ -72,10 +136,149 @@ public:
     bool operator==(const npc_ref& o) { return level_x == o.level_x && level_y == o.level_y && id == o.id; }
   };
 
-  typedef boost::multi_array<boost::shared_ptr<level>, 2> level_list_type;
+  struct level_entry {
+    boost::shared_ptr<level> level_ptr;
+    // Value of the map's access counter when this level was last requested
+    unsigned long last_used;
+    // Modified levels are never evicted
+    bool modified;
+    // Content hash of the level when it was loaded or last saved
+    boost::uint64_t saved_hash;
+    // The file of a level shared through the level registry, or empty
+    boost::filesystem::path shared_path;
+    /* Tile layers of a modified level that wasn't used for a while, the
+     * level's own layers are empty then. get_level expands them again */
+    std::vector<compressed_tile_buf> compressed_layers;
+    bool compressed;
+
+    level_entry(): last_used(0), modified(false), saved_hash(0), compressed(false) {}
+  };
+
+  typedef std::map<std::pair<int, int>, level_entry> level_list_type;
+  typedef std::map<std::pair<int, int>, level_snapshot> snapshot_type;
+
+  /* A changed part of one level layer, in level coordinates. Changes to
+   * the objects of a level (NPCs, links, signs) are reported as a rectangle
+   * covering the whole level on layer -1 */
+  struct dirty_rect {
+    int level_x, level_y;
+    int layer;
+    int x, y, width, height;
+  };
+
+  typedef std::vector<dirty_rect> dirty_rect_list_type;
+
+  // A change to a level shared through a level_registry
+  struct shared_change {
+    const level* changed_level;
+    dirty_rect rect;
+  };
+  typedef std::vector<shared_change> shared_change_list_type;
+
+  /* Batches change notifications. While at least one edit_scope is alive,
+   * changes are merged into one dirty rectangle per level and layer, and
+   * signal_level_changed (once per level) and signal_dirty_rects are
+   * emitted when the outermost scope ends:
+   *
+   *   {
+   *     level_map::edit_scope scope(map);
+   *     map.set_tile(...); map.set_tile(...);
+   *   } // notifications are sent here
+   *
+   * Changes made outside of any scope are signalled right away. */
+  class edit_scope: boost::noncopyable {
+  public:
+    explicit edit_scope(level_map& map);
+    ~edit_scope();
+  private:
+    level_map& m_map;
+  };
+
+  /* Walks a rectangle of GLOBAL tile positions on one layer, split into
+   * spans of consecutive tiles inside a single level row. Levels are
+   * resolved once per level instead of once per tile, and each span points
+   * directly into the level's tile_buf:
+   *
+   *   level_map::tile_region region(map, x, y, width, height, layer, true);
+   *   while (region.next()) {
+   *     tile* tiles = region.get_tiles();
+   *     for (int i = 0; i < region.get_span_width(); ++i) ...
+   *   }
+   *
+   * Read-only users should use read_tiles(), get_tiles() unshares the row.
+   *
+   * Spans are ordered level by level, not globally row by row. Parts of the
+   * rectangle outside the map or in levels that don't exist are skipped.
+   * If writable, the walked part of every level is marked dirty, and the
+   * notifications are sent once the region is destroyed. */
+  class tile_region: boost::noncopyable {
+  public:
+    tile_region(level_map& map, int x, int y, int width, int height,
+                int layer = 0, bool writable = false);
+    ~tile_region();
+
+    // Advances to the next span, returns false once the region is done
+    bool next();
+
+    // GLOBAL position of the first tile of the current span
+    int get_x() const { return m_level_x * m_map.get_level_width() + m_span_x; }
+    int get_y() const { return m_level_y * m_map.get_level_height() + m_row; }
+    // Position of the first tile of the current span relative to the region
+    int get_region_x() const { return get_x() - m_x; }
+    int get_region_y() const { return get_y() - m_y; }
+    int get_span_width() const { return m_span_width; }
+
+    tile* get_tiles() { return m_buf->get_row(m_row) + m_span_x; }
+    const tile* read_tiles() const {
+      return static_cast<const tile_buf*>(m_buf)->get_row(m_row) + m_span_x;
+    }
+  private:
+    // Moves on to the next existing level, returns false if there is none
+    bool next_level();
+    void finish_level();
+
+    level_map& m_map;
+    edit_scope m_scope;
+    int m_x, m_y, m_width, m_height;
+    int m_layer;
+    bool m_writable;
+
+    // The level currently walked and the rows/columns of it inside the region
+    int m_level_x, m_level_y;
+    int m_first_level_x, m_last_level_x, m_last_level_y;
+    tile_buf* m_buf;
+    int m_row, m_first_row, m_end_row;
+    int m_span_x, m_span_width;
+  };
+
+  /* Random access to GLOBAL tile positions on one layer that remembers the
+   * last accessed level, for operations like flood fills that mostly stay
+   * inside one level. Tiles changed through set_tile are marked dirty, and
+   * the notifications are sent once the accessor is destroyed */
+  class tile_accessor: boost::noncopyable {
+  public:
+    tile_accessor(level_map& map, int layer = 0);
+    ~tile_accessor();
+
+    // Returns 0 for positions outside of the map or in missing levels
+    const tile* get_tile(int x, int y);
+    // Returns false if the position is outside of the map or in a missing level
+    bool set_tile(const tile& _tile, int x, int y);
+  private:
+    // Makes the level of the position current, returns false if there is none
+    bool find_level(int x, int y);
+
+    level_map& m_map;
+    edit_scope m_scope;
+    int m_layer;
+
+    int m_level_x, m_level_y;
+    tile_buf* m_buf;
+  };
   static level_map* load_from_gmap(filesystem& _filesystem, const boost::filesystem::path& _file_name);
 
   level_map();
+  ~level_map();
 
   // gets/sets a level source to use in case get_level can't find a level
   void set_level_source(const boost::shared_ptr<level_map_source>& source);
@@ -86,11 +289,46 @@ public:
   void set_level(level* _level, int x = 0, int y = 0);
   // Returns the level at the specified location
   const boost::shared_ptr<level>& get_level(int x, int y);
-  // Returns all levels
-  /* TODO: is this actually needed? It'd be possibly to iterate over all
-   * levels easily that way, but we'd lack the level's position, making it
-   * rather useless. */
+  // Returns all loaded levels, keyed by their position
   level_list_type& get_levels();
+  /* Returns snapshots of all loaded levels for reading on another thread.
+   * Levels that aren't loaded are unchanged from their source */
+  snapshot_type snapshot() const;
+
+  /* Marks a level as modified (or not). Modified levels are kept in memory
+   * until they are marked as unmodified again, usually after saving */
+  void set_level_modified(int x, int y, bool modified);
+  bool is_level_modified(int x, int y) const;
+
+  /* Whether the contents of a level differ from when it was loaded or
+   * passed to mark_level_saved, by comparing content hashes */
+  bool is_level_changed(int x, int y);
+  void mark_level_saved(int x, int y);
+
+  // get/set the amount of levels to keep loaded before evicting any
+  std::size_t get_max_loaded_levels() const;
+  void set_max_loaded_levels(std::size_t max_levels);
+  std::size_t get_loaded_level_count() const;
+
+  /* Shares levels loaded afterwards with all other level maps using the
+   * same registry, changes to shared levels are reported by all of them */
+  void set_level_registry(const boost::shared_ptr<level_registry>& registry);
+
+  /* Enables sharing equal tile rows between all levels loaded afterwards.
+   * Shared rows are copied on write, see tile_buf */
+  void set_intern_rows(bool intern);
+  bool get_intern_rows() const;
+
+  /* Drops the least recently used unmodified levels until at most
+   * get_max_loaded_levels() levels are loaded. Levels still referenced
+   * elsewhere and levels that can't be reloaded from the level source are
+   * kept. If too many are left, the tiles of the least recently used
+   * modified levels get compressed until at most get_max_loaded_levels()
+   * levels are expanded. Invalidates pointers returned by get_level, so only
+   * call this when no one holds on to a level, e.g. after drawing a frame */
+  void evict_levels();
+  // Number of loaded levels with compressed tiles
+  std::size_t get_compressed_level_count() const;
 
   /* Loads the level at the specified GLOBAL position if it is not loaded
    * already and returns the tile from inside that level */
@@ -98,6 +336,12 @@ public:
   void set_tile(const tile& tile, int x, int y, int layer = 0);
   bool is_valid_tile(int x, int y);
 
+  /* Records a change of the passed rectangle (in level coordinates) of a
+   * level layer, see edit_scope */
+  void mark_dirty(int level_x, int level_y, int layer, int x, int y, int width, int height);
+  // Records a change to the objects of a level
+  void mark_level_changed(int level_x, int level_y);
+
   /* Return the list of NPCs from the level at the specified tile position.
    * Loads the level if it is not loaded already */
   level::npc_list_type& get_npcs(int x, int y);
@@ -108,6 +352,8 @@ public:
 
   npc* get_npc(const npc_ref& ref);
   void delete_npc(const npc_ref& ref);
+  // Replaces the referenced NPC with new_npc, keeping its id
+  void update_npc(const npc_ref& ref, const npc& new_npc);
   // in global coords, might update ref if level changes
   npc* move_npc(npc_ref& ref, float new_x, float new_y);
   // Return the global position of the references NPC
@@ -126,22 +372,71 @@ public:
   int get_level_height() const;
   void set_level_size(int width, int height);
 
+  /* Split a GLOBAL tile position into the level containing it and the
+   * position inside that level. The Graal default level size takes a path
+   * with compile-time shifts and masks, other sizes divide */
+  int to_level_x(int x) const {
+    return m_default_level_size ? default_level_size::to_level_x(x) : x / m_level_width;
+  }
+  int to_level_y(int y) const {
+    return m_default_level_size ? default_level_size::to_level_y(y) : y / m_level_height;
+  }
+  int to_tile_x(int x) const {
+    return m_default_level_size ? default_level_size::to_tile_x(x) : x % m_level_width;
+  }
+  int to_tile_y(int y) const {
+    return m_default_level_size ? default_level_size::to_tile_y(y) : y % m_level_height;
+  }
+
   // Signal to notify users if a specific level was changed
   typedef sigc::signal<void, int, int> signal_level_changed_type;
   signal_level_changed_type& signal_level_changed();
+
+  /* Signal carrying all changes of an edit_scope at once, for users that
+   * only want to update the changed parts */
+  typedef sigc::signal<void, const dirty_rect_list_type&> signal_dirty_rects_type;
+  signal_dirty_rects_type& signal_dirty_rects();
 protected:
   signal_level_changed_type m_signal_level_changed;
+  signal_dirty_rects_type m_signal_dirty_rects;
 
   // Keep this protected so we can signal on level changes
   tile& get_tile_editable(int x, int y, int layer = 0);
+  // Returns the tiles of the level at the GLOBAL tile position, throws outside the map
+  tile_buf& get_level_tiles(int x, int y, int layer);
 
   // Size of one level in tiles
   int m_level_width, m_level_height;
+  // Whether the level size is default_level_size
+  bool m_default_level_size;
+  // Size of the map in levels
+  int m_width, m_height;
 
   // Contains the loaded levels
   level_list_type m_level_list;
+  unsigned long m_access_counter;
+  std::size_t m_max_loaded_levels;
+
+  // Compresses/expands the tile layers of a level entry
+  void compress_level(level_entry& entry);
+  void expand_level(level_entry& entry);
+
+  // Emits the notifications for all changes collected so far
+  void flush_changes();
+  void emit_changes(const dirty_rect_list_type& rects);
+  // Reports changes other level maps made to levels shared with this one
+  void on_registry_changed(const level_map* sender, const shared_change_list_type& changes);
+
+  // Number of alive edit scopes
+  int m_edit_depth;
+  // The collected changes, keyed by level and layer
+  typedef std::map<std::pair<std::pair<int, int>, int>, dirty_rect> dirty_rect_map_type;
+  dirty_rect_map_type m_dirty_rects;
 
   boost::shared_ptr<level_map_source> m_level_source;
+  boost::shared_ptr<tile_row_store> m_row_store;
+  boost::shared_ptr<level_registry> m_registry;
+  sigc::connection m_registry_connection;
 };
 
 }
@@ -0,0 +1,57 @@
+#include "level_registry.hpp"
+
+#include <boost/filesystem/operations.hpp>
+
+using namespace Graal;
+using namespace Graal::level_editor;
+
+std::string level_registry::get_key(const boost::filesystem::path& path) {
+  boost::system::error_code error;
+  boost::filesystem::path key = boost::filesystem::canonical(path, error);
+  if (error)
+    key = boost::filesystem::absolute(path);
+  return key.string();
+}
+
+void level_registry::purge() {
+  level_list_type::iterator iter = m_levels.begin();
+  while (iter != m_levels.end()) {
+    if (iter->second.level_ptr.expired())
+      m_levels.erase(iter++);
+    else
+      ++iter;
+  }
+}
+
+boost::shared_ptr<level> level_registry::find(const boost::filesystem::path& path, boost::uint64_t& saved_hash) {
+  level_list_type::iterator iter = m_levels.find(get_key(path));
+  if (iter == m_levels.end())
+    return boost::shared_ptr<level>();
+
+  saved_hash = iter->second.saved_hash;
+  return iter->second.level_ptr.lock();
+}
+
+void level_registry::add(const boost::filesystem::path& path, const boost::shared_ptr<level>& _level,
+                         boost::uint64_t saved_hash) {
+  purge();
+
+  entry& new_entry = m_levels[get_key(path)];
+  new_entry.level_ptr = _level;
+  new_entry.saved_hash = saved_hash;
+}
+
+void level_registry::set_saved_hash(const boost::filesystem::path& path, boost::uint64_t saved_hash) {
+  level_list_type::iterator iter = m_levels.find(get_key(path));
+  if (iter != m_levels.end())
+    iter->second.saved_hash = saved_hash;
+}
+
+void level_registry::notify_changed(const level_map* sender, const change_list_type& changes) {
+  if (!changes.empty())
+    m_signal_changed(sender, changes);
+}
+
+level_registry::signal_changed_type& level_registry::signal_changed() {
+  return m_signal_changed;
+}
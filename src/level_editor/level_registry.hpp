@@ -0,0 +1,59 @@
+#ifndef GRAAL_LEVEL_EDITOR_LEVEL_REGISTRY_HPP_
+#define GRAAL_LEVEL_EDITOR_LEVEL_REGISTRY_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <sigc++/signal.h>
+
+#include "level_map.hpp"
+
+namespace Graal {
+  namespace level_editor {
+    /* Shares the levels loaded from the same file between all level maps
+     * of a workspace, so a level that is part of several open GMaps is only
+     * loaded once and edits show up everywhere. Only weak references are
+     * kept, a level is dropped once no level map uses it anymore */
+    class level_registry: boost::noncopyable {
+    public:
+      // The rects of the changes are in the coordinates of the sender
+      typedef level_map::shared_change_list_type change_list_type;
+      typedef sigc::signal<void, const level_map*, const change_list_type&> signal_changed_type;
+
+      /* Returns the level loaded from path if any level map still uses it,
+       * together with its content hash when it was loaded or last saved */
+      boost::shared_ptr<level> find(const boost::filesystem::path& path, boost::uint64_t& saved_hash);
+      void add(const boost::filesystem::path& path, const boost::shared_ptr<level>& _level,
+               boost::uint64_t saved_hash);
+
+      void set_saved_hash(const boost::filesystem::path& path, boost::uint64_t saved_hash);
+
+      // Passes changes to shared levels on to all other level maps
+      void notify_changed(const level_map* sender, const change_list_type& changes);
+      signal_changed_type& signal_changed();
+    private:
+      struct entry {
+        boost::weak_ptr<level> level_ptr;
+        boost::uint64_t saved_hash;
+      };
+
+      typedef std::map<std::string, entry> level_list_type;
+
+      // Equal files get the same key regardless of how they were reached
+      static std::string get_key(const boost::filesystem::path& path);
+      // Forgets levels no level map uses anymore
+      void purge();
+
+      level_list_type m_levels;
+      signal_changed_type m_signal_changed;
+    };
+  }
+}
+
+#endif
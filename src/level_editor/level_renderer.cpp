@@ -0,0 +1,412 @@
+#include "level_renderer.hpp"
+#include "level_map.hpp"
+#include "image_cache.hpp"
+#include "helper.hpp"
+
+#include <glib.h>
+#include <png.h>
+#include <algorithm>
+#include <cstdio>
+#include <csetjmp>
+#include <stdexcept>
+
+using namespace Graal;
+using namespace Graal::level_editor;
+
+namespace {
+  // Jobs are at most this many tiles wide, so single levels get split too
+  const int job_columns = 16;
+
+  // x * a / 255, rounded
+  inline boost::uint32_t multiply(boost::uint32_t x, boost::uint32_t a) {
+    const boost::uint32_t t = x * a + 128;
+    return ((t >> 8) + t) >> 8;
+  }
+
+  // Draws the premultiplied pixel source over dest
+  inline void blend_pixel(boost::uint32_t& dest, boost::uint32_t source) {
+    const boost::uint32_t alpha = source >> 24;
+    if (alpha == 255) {
+      dest = source;
+    } else if (alpha) {
+      const boost::uint32_t inverse = 255 - alpha;
+      boost::uint32_t result = source;
+      for (int shift = 0; shift < 32; shift += 8)
+        result += multiply((dest >> shift) & 0xff, inverse) << shift;
+      dest = result;
+    }
+  }
+
+  /* Turns premultiplied ARGB32 pixels into the straight RGBA bytes PNG
+   * wants, in place */
+  void unpremultiply(boost::uint32_t* pixels, int count) {
+    for (int i = 0; i < count; ++i) {
+      const boost::uint32_t pixel = pixels[i];
+      const boost::uint32_t alpha = pixel >> 24;
+      unsigned char* bytes = reinterpret_cast<unsigned char*>(pixels + i);
+      if (alpha == 0) {
+        bytes[0] = bytes[1] = bytes[2] = bytes[3] = 0;
+        continue;
+      }
+
+      bytes[0] = static_cast<unsigned char>((((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha);
+      bytes[1] = static_cast<unsigned char>((((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha);
+      bytes[2] = static_cast<unsigned char>(((pixel & 0xff) * 255 + alpha / 2) / alpha);
+      bytes[3] = static_cast<unsigned char>(alpha);
+    }
+  }
+
+  /* Writes a PNG file row by row. libpng reports errors with longjmp, so
+   * every call into it sits in a function without C++ objects to unwind */
+  class png_writer: boost::noncopyable {
+  public:
+    png_writer(): m_file(0), m_png(0), m_info(0) {}
+
+    ~png_writer() {
+      if (m_png)
+        png_destroy_write_struct(&m_png, &m_info);
+      if (m_file)
+        std::fclose(m_file);
+    }
+
+    void open(const boost::filesystem::path& file_name, int width, int height) {
+      m_file = std::fopen(file_name.string().c_str(), "wb");
+      if (!m_file)
+        throw std::runtime_error("Could not open " + file_name.string() + " for writing");
+
+      m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+      if (m_png)
+        m_info = png_create_info_struct(m_png);
+      if (!m_info || !write_header(width, height))
+        throw std::runtime_error("Could not write PNG header to " + file_name.string());
+    }
+
+    void write_row(const void* row) {
+      if (!write_row(m_png, static_cast<png_bytep>(const_cast<void*>(row))))
+        throw std::runtime_error("Could not write PNG data");
+    }
+
+    void close() {
+      if (!write_end(m_png, m_info))
+        throw std::runtime_error("Could not finish PNG file");
+      png_destroy_write_struct(&m_png, &m_info);
+      m_png = 0;
+      m_info = 0;
+
+      const int result = std::fclose(m_file);
+      m_file = 0;
+      if (result != 0)
+        throw std::runtime_error("Could not close PNG file");
+    }
+  private:
+    bool write_header(int width, int height) {
+      if (setjmp(png_jmpbuf(m_png)))
+        return false;
+
+      png_init_io(m_png, m_file);
+      png_set_IHDR(m_png, m_info,
+        static_cast<png_uint_32>(width), static_cast<png_uint_32>(height),
+        8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+      png_write_info(m_png, m_info);
+      return true;
+    }
+
+    static bool write_row(png_structp png, png_bytep row) {
+      if (setjmp(png_jmpbuf(png)))
+        return false;
+
+      png_write_row(png, row);
+      return true;
+    }
+
+    static bool write_end(png_structp png, png_infop info) {
+      if (setjmp(png_jmpbuf(png)))
+        return false;
+
+      png_write_end(png, info);
+      return true;
+    }
+
+    std::FILE* m_file;
+    png_structp m_png;
+    png_infop m_info;
+  };
+}
+
+level_renderer::level_renderer(level_map& map, image_cache& cache,
+                               const Cairo::RefPtr<Cairo::ImageSurface>& tileset,
+                               int tile_width, int tile_height):
+    m_level_map(map), m_image_cache(cache),
+    m_tile_width(tile_width), m_tile_height(tile_height),
+    m_thread_count(0), m_band_size(64 * 1024 * 1024), m_draw_npcs(true),
+    m_band_top(0), m_band_width(0), m_band_height(0), m_band_row(0),
+    m_level_pixel_width(0), m_job_count(0), m_next_job(0), m_finished_jobs(0),
+    m_stopping(false) {
+  convert_surface(tileset, m_tileset);
+}
+
+void level_renderer::set_thread_count(unsigned int count) {
+  m_thread_count = count;
+}
+
+void level_renderer::set_band_size(std::size_t bytes) {
+  m_band_size = bytes;
+}
+
+void level_renderer::set_draw_npcs(bool draw) {
+  m_draw_npcs = draw;
+}
+
+void level_renderer::convert_surface(const Cairo::RefPtr<Cairo::ImageSurface>& surface, image& result) {
+  result.width = surface->get_width();
+  result.height = surface->get_height();
+  result.pixels.resize(static_cast<std::size_t>(result.width * result.height));
+
+  surface->flush();
+  const unsigned char* data = surface->get_data();
+  const int stride = surface->get_stride();
+  // RGB24 leaves the alpha byte undefined
+  const boost::uint32_t alpha = surface->get_format() == Cairo::FORMAT_ARGB32 ? 0 : 0xff000000;
+  for (int y = 0; y < result.height; ++y) {
+    const boost::uint32_t* row = reinterpret_cast<const boost::uint32_t*>(data + y * stride);
+    boost::uint32_t* dest = &result.pixels[static_cast<std::size_t>(y * result.width)];
+    for (int x = 0; x < result.width; ++x)
+      dest[x] = row[x] | alpha;
+  }
+}
+
+const level_renderer::image* level_renderer::get_npc_image(const image_handle& handle) {
+  const std::size_t id = handle.get_id();
+  if (id >= m_npc_images.size())
+    m_npc_images.resize(id + 1);
+
+  boost::shared_ptr<image>& cached = m_npc_images[id];
+  if (!cached) {
+    cached.reset(new image());
+    convert_surface(m_image_cache.get_image(handle), *cached);
+  }
+  return cached.get();
+}
+
+void level_renderer::render(const boost::filesystem::path& file_name) {
+  const int level_width = m_level_map.get_level_width();
+  const int level_height = m_level_map.get_level_height();
+  const int map_width = m_level_map.get_width();
+  const int map_height = m_level_map.get_height();
+
+  m_level_pixel_width = level_width * m_tile_width;
+  const int level_pixel_height = level_height * m_tile_height;
+  m_band_width = map_width * m_level_pixel_width;
+  const int pixel_height = map_height * level_pixel_height;
+  if (m_band_width <= 0 || pixel_height <= 0)
+    throw std::runtime_error("level_renderer::render: the map is empty");
+
+  // As many tile rows per band as fit, bands don't cross level rows
+  const std::size_t tile_row_size =
+    static_cast<std::size_t>(m_band_width) * static_cast<std::size_t>(m_tile_height) * 4;
+  const int band_rows = static_cast<int>(std::max<std::size_t>(1,
+    std::min<std::size_t>(level_height, m_band_size / tile_row_size)));
+  m_band.resize(static_cast<std::size_t>(m_band_width) * band_rows * m_tile_height);
+
+  unsigned int thread_count = m_thread_count;
+  if (!thread_count)
+    thread_count = static_cast<unsigned int>(std::max(1, g_get_num_processors()));
+
+  png_writer writer;
+  writer.open(file_name, m_band_width, pixel_height);
+
+  // The workers wait for the jobs of each band, until rendering ends
+  struct worker_stopper {
+    level_renderer& renderer;
+    ~worker_stopper() { renderer.stop_workers(); }
+  } stopper = { *this };
+  m_stopping = false;
+  for (unsigned int i = 0; i < thread_count; ++i) {
+    m_workers.push_back(Glib::Threads::Thread::create(
+      sigc::mem_fun(*this, &level_renderer::run_worker)));
+  }
+
+  // NPCs of this and earlier level rows reaching into this level row
+  npc_image_list_type npcs;
+  std::vector<level_snapshot> snapshots(static_cast<std::size_t>(map_width));
+
+  for (int level_y = 0; level_y < map_height; ++level_y) {
+    // Snapshot the level row, the workers only read the snapshots
+    m_jobs.clear();
+    for (int level_x = 0; level_x < map_width; ++level_x) {
+      level_snapshot& snapshot = snapshots[static_cast<std::size_t>(level_x)];
+      snapshot.reset();
+
+      const boost::shared_ptr<level>& current_level = m_level_map.get_level(level_x, level_y);
+      if (!current_level)
+        continue;
+      snapshot = snapshot_level(*current_level);
+
+      if (m_draw_npcs) {
+        level::npc_list_type::const_iterator iter, end = snapshot->npcs.end();
+        for (iter = snapshot->npcs.begin(); iter != end; ++iter) {
+          npc_image placed;
+          placed.x = level_x * m_level_pixel_width + static_cast<int>(iter->get_level_x() * m_tile_width);
+          placed.y = level_y * level_pixel_height + static_cast<int>(iter->get_level_y() * m_tile_height);
+          placed.source = get_npc_image(iter->image);
+          npcs.push_back(placed);
+        }
+      }
+
+      for (int column = 0; column < level_width; column += job_columns) {
+        job new_job;
+        new_job.source = snapshot.get();
+        new_job.level_x = level_x;
+        new_job.first_column = column;
+        new_job.columns = std::min(job_columns, level_width - column);
+        m_jobs.push_back(new_job);
+      }
+    }
+    m_level_map.evict_levels();
+
+    for (m_band_row = 0; m_band_row < level_height; m_band_row += band_rows) {
+      m_band_top = level_y * level_pixel_height + m_band_row * m_tile_height;
+      m_band_height = std::min(band_rows, level_height - m_band_row) * m_tile_height;
+
+      m_band_npcs.clear();
+      npc_image_list_type::const_iterator iter, end = npcs.end();
+      for (iter = npcs.begin(); iter != end; ++iter) {
+        if (iter->y < m_band_top + m_band_height && iter->y + iter->source->height > m_band_top)
+          m_band_npcs.push_back(*iter);
+      }
+
+      // Missing levels leave their part of the band transparent
+      std::fill(m_band.begin(), m_band.end(), 0);
+
+      render_band();
+
+      for (int y = 0; y < m_band_height; ++y)
+        writer.write_row(&m_band[static_cast<std::size_t>(y * m_band_width)]);
+    }
+
+    // Forget NPCs that don't reach into the next level row
+    const int next_row_top = (level_y + 1) * level_pixel_height;
+    npc_image_list_type::iterator remove_begin = npcs.begin();
+    for (npc_image_list_type::iterator iter = npcs.begin(); iter != npcs.end(); ++iter) {
+      if (iter->y + iter->source->height > next_row_top)
+        *remove_begin++ = *iter;
+    }
+    npcs.erase(remove_begin, npcs.end());
+  }
+
+  writer.close();
+  m_band.clear();
+  m_jobs.clear();
+  m_band_npcs.clear();
+}
+
+void level_renderer::run_worker() {
+  Glib::Threads::Mutex::Lock lock(m_jobs_mutex);
+  for (;;) {
+    if (m_next_job < m_job_count) {
+      const std::size_t index = m_next_job++;
+      lock.release();
+      render_job(m_jobs[index]);
+      lock.acquire();
+
+      if (++m_finished_jobs == m_job_count)
+        m_jobs_done.signal();
+    } else if (m_stopping) {
+      return;
+    } else {
+      m_jobs_ready.wait(m_jobs_mutex);
+    }
+  }
+}
+
+void level_renderer::render_band() {
+  Glib::Threads::Mutex::Lock lock(m_jobs_mutex);
+  m_job_count = m_jobs.size();
+  m_next_job = 0;
+  m_finished_jobs = 0;
+  m_jobs_ready.broadcast();
+
+  while (m_finished_jobs < m_job_count)
+    m_jobs_done.wait(m_jobs_mutex);
+  m_job_count = 0;
+}
+
+void level_renderer::stop_workers() {
+  {
+    Glib::Threads::Mutex::Lock lock(m_jobs_mutex);
+    m_stopping = true;
+    m_jobs_ready.broadcast();
+  }
+
+  std::vector<Glib::Threads::Thread*>::const_iterator iter, end = m_workers.end();
+  for (iter = m_workers.begin(); iter != end; ++iter)
+    (*iter)->join();
+  m_workers.clear();
+}
+
+void level_renderer::render_job(const job& current_job) {
+  const int left = current_job.level_x * m_level_pixel_width + current_job.first_column * m_tile_width;
+  const int right = left + current_job.columns * m_tile_width;
+  const int rows = m_band_height / m_tile_height;
+
+  const level& source = *current_job.source;
+  const int layer_count = source.get_layer_count();
+  for (int layer = 0; layer < layer_count; ++layer) {
+    const tile_buf& tiles = source.get_tiles(layer);
+    if (tiles.empty())
+      continue;
+
+    const int end_column = std::min(tiles.get_width(), current_job.first_column + current_job.columns);
+    const int end_row = std::min(tiles.get_height(), m_band_row + rows);
+    for (int y = m_band_row; y < end_row; ++y) {
+      const tile* row = tiles.get_row(y);
+      for (int x = current_job.first_column; x < end_column; ++x) {
+        const int index = row[x].index;
+        // Transparent and invalid tiles
+        if (index < 0)
+          continue;
+
+        draw_image(m_tileset,
+          helper::get_tile_x(index) * m_tile_width, helper::get_tile_y(index) * m_tile_height,
+          current_job.level_x * m_level_pixel_width + x * m_tile_width, (y - m_band_row) * m_tile_height,
+          m_tile_width, m_tile_height,
+          left, right);
+      }
+    }
+  }
+
+  npc_image_list_type::const_iterator iter, end = m_band_npcs.end();
+  for (iter = m_band_npcs.begin(); iter != end; ++iter) {
+    if (iter->x >= right || iter->x + iter->source->width <= left)
+      continue;
+
+    draw_image(*iter->source, 0, 0,
+      iter->x, iter->y - m_band_top,
+      iter->source->width, iter->source->height,
+      left, right);
+  }
+
+  // The job's part of the band is done, turn it into PNG pixels
+  for (int y = 0; y < m_band_height; ++y)
+    unpremultiply(&m_band[static_cast<std::size_t>(y * m_band_width + left)], right - left);
+}
+
+void level_renderer::draw_image(const image& source, int source_x, int source_y,
+                                int x, int y, int width, int height, int left, int right) {
+  // Clip against the source image, the band and the job's columns
+  int x1 = std::max(x, std::max(left, x - source_x));
+  int y1 = std::max(y, std::max(0, y - source_y));
+  int x2 = std::min(x + width, std::min(right, x - source_x + source.width));
+  int y2 = std::min(y + height, std::min(m_band_height, y - source_y + source.height));
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  for (int dest_y = y1; dest_y < y2; ++dest_y) {
+    const boost::uint32_t* source_row =
+      &source.pixels[static_cast<std::size_t>((dest_y - y + source_y) * source.width + (x1 - x + source_x))];
+    boost::uint32_t* dest_row = &m_band[static_cast<std::size_t>(dest_y * m_band_width + x1)];
+    for (int i = 0; i < x2 - x1; ++i)
+      blend_pixel(dest_row[i], source_row[i]);
+  }
+}
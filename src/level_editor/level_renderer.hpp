@@ -0,0 +1,115 @@
+#pragma once
+
+#include "level.hpp"
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/filesystem/path.hpp>
+#include <cairomm/surface.h>
+#include <glibmm/threads.h>
+#include <cstddef>
+#include <vector>
+
+namespace Graal {
+namespace level_editor {
+
+class level_map;
+class image_cache;
+
+/* Renders a whole level map at full resolution into a PNG file without
+ * OpenGL, for maps larger than any framebuffer. The image is made in bands
+ * of tile rows, each band is split into jobs of a few tile columns and the
+ * jobs are composited by worker threads started once per render. Finished
+ * bands are written to the file right away, so only one band is in memory
+ * at a time.
+ *
+ * Levels are read through snapshots taken on the calling thread, the level
+ * map is only used by the calling thread and levels get evicted as usual */
+class level_renderer: boost::noncopyable {
+public:
+  level_renderer(level_map& map, image_cache& cache,
+                 const Cairo::RefPtr<Cairo::ImageSurface>& tileset,
+                 int tile_width = 16, int tile_height = 16);
+
+  // Number of worker threads, 0 uses one per core
+  void set_thread_count(unsigned int count);
+  // Upper limit of the memory used for one band, at least one tile row is used
+  void set_band_size(std::size_t bytes);
+  void set_draw_npcs(bool draw);
+
+  // Renders the map into file_name, throws std::runtime_error on failure
+  void render(const boost::filesystem::path& file_name);
+protected:
+  // Premultiplied ARGB32 pixels like cairo's, rows without padding
+  struct image {
+    image(): width(0), height(0) {}
+
+    int width, height;
+    std::vector<boost::uint32_t> pixels;
+  };
+
+  // An NPC image placed in image pixels
+  struct npc_image {
+    int x, y;
+    const image* source;
+  };
+  typedef std::vector<npc_image> npc_image_list_type;
+
+  /* One part of the band currently rendered: the tile columns
+   * first_column up to first_column + columns of a level */
+  struct job {
+    const level* source;
+    int level_x;
+    int first_column, columns;
+  };
+
+  static void convert_surface(const Cairo::RefPtr<Cairo::ImageSurface>& surface, image& result);
+  const image* get_npc_image(const image_handle& handle);
+
+  // Worker thread, renders the jobs of each band until stopped
+  void run_worker();
+  // Hands the jobs of the current band to the workers and waits for them
+  void render_band();
+  void stop_workers();
+  void render_job(const job& current_job);
+  /* Draws width x height pixels of source at x, y of the band, clipped to
+   * the columns left up to right */
+  void draw_image(const image& source, int source_x, int source_y,
+                  int x, int y, int width, int height, int left, int right);
+
+  level_map& m_level_map;
+  image_cache& m_image_cache;
+  image m_tileset;
+  int m_tile_width, m_tile_height;
+
+  unsigned int m_thread_count;
+  std::size_t m_band_size;
+  bool m_draw_npcs;
+
+  // NPC images by image handle id, empty if not converted yet
+  std::vector<boost::shared_ptr<image> > m_npc_images;
+
+  // The band currently rendered, its top in image pixels and its size
+  std::vector<boost::uint32_t> m_band;
+  int m_band_top, m_band_width, m_band_height;
+  // Tile row of the levels the band starts at
+  int m_band_row;
+  int m_level_pixel_width;
+  npc_image_list_type m_band_npcs;
+
+  std::vector<job> m_jobs;
+  std::vector<Glib::Threads::Thread*> m_workers;
+  /* Guards the counters below. Workers only look at m_jobs and the band
+   * while m_job_count is set, in between the rendering thread changes them */
+  Glib::Threads::Mutex m_jobs_mutex;
+  // Signalled when a band's jobs are handed out, or the workers should stop
+  Glib::Threads::Cond m_jobs_ready;
+  // Signalled when the last job of a band is done
+  Glib::Threads::Cond m_jobs_done;
+  std::size_t m_job_count, m_next_job, m_finished_jobs;
+  bool m_stopping;
+};
+
+}
+}
@@ -143,12 +143,13 @@ void level_editor::link_list::on_edit_clicked() {
     Gtk::TreeRow row = *iter;
     
     // get selected link
-    link& _link = *row.get_value(columns.iter);
+    level::link_list_type::iterator link_iter = row.get_value(columns.iter);
     edit_link edit_window(m_window);
-    edit_window.get(_link);
+    edit_window.get(*link_iter);
     if (edit_window.run() == Gtk::RESPONSE_OK) {
       // save link
-      _link = edit_window.get_link();
+      m_window.get_current_level()->update_link(link_iter, edit_window.get_link());
+      m_window.get_current_level_display()->mark_current_level_changed();
       // TODO: this should probably not be here
       m_window.get_current_level_display()->queue_draw();
     }
@@ -162,7 +163,8 @@ void level_editor::link_list::on_delete_clicked() {
   Gtk::TreeModel::iterator iter = selection->get_selected();
   if (iter) {
     Gtk::TreeRow row = *iter;
-    m_window.get_current_level()->links.erase(row.get_value(columns.iter));
+    m_window.get_current_level()->delete_link(row.get_value(columns.iter));
+    m_window.get_current_level_display()->mark_current_level_changed();
     get();
     m_window.get_current_level_display()->queue_draw();
   }
@@ -1,7 +1,14 @@
 #include "window.hpp"
 #include "preferences.hpp"
 #include "preferences_display.hpp"
+#include "filesystem.hpp"
+#include "image_cache.hpp"
+#include "level_map.hpp"
+#include "level_renderer.hpp"
+#include "tileset_display.hpp"
+#include "helper.hpp"
 #include <gtkmm.h>
+#include <cstring>
 #include <iostream>
 #include <boost/filesystem.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -48,16 +55,84 @@ namespace {
     editor->signal_hide().connect(sigc::ptr_fun(&Gtk::Main::quit));
     editor->show_all();
   }
-}
 
-int main(int argc, char* argv[]) {
-  Gtk::Main kit(argc, argv);
+  int render_usage(const char* program) {
+    std::cerr << "Usage: " << program
+              << " --render <level.nw|map.gmap> <image.png> [--threads n] [--no-npcs]" << std::endl;
+    return 1;
+  }
 
-  if (!gdk_gl_query()) {
-    std::cerr << "No OpenGL support" << std::endl;
-    return -1;
+  /* Renders a level or GMap into a PNG file without a display:
+   *   gonstruct --render <level.nw|map.gmap> <image.png> [--threads n] [--no-npcs] */
+  int render_map(int argc, char* argv[], Graal::level_editor::preferences& prefs) {
+    using namespace Graal::level_editor;
+
+    if (argc < 4)
+      return render_usage(argv[0]);
+
+    const boost::filesystem::path file_path(argv[2]);
+    const boost::filesystem::path image_path(argv[3]);
+    unsigned int thread_count = 0;
+    bool draw_npcs = true;
+    for (int i = 4; i < argc; i ++) {
+      if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+        int threads = 0;
+        if (!Graal::helper::parse(argv[++i], threads) || threads < 1) {
+          std::cerr << "Invalid thread count " << argv[i] << std::endl;
+          return render_usage(argv[0]);
+        }
+        thread_count = static_cast<unsigned int>(threads);
+      } else if (std::strcmp(argv[i], "--no-npcs") == 0) {
+        draw_npcs = false;
+      } else {
+        std::cerr << "Unknown option " << argv[i] << std::endl;
+        return render_usage(argv[0]);
+      }
+    }
+
+    try {
+      filesystem fs(prefs);
+      fs.update_cache();
+      image_cache cache(fs);
+
+      boost::shared_ptr<level_map_source> source;
+      if (file_path.extension() == ".gmap") {
+        source.reset(new gmap_level_map_source(fs, file_path));
+      } else if (file_path.extension() == ".nw") {
+        // Levels larger than the default size get split into chunks
+        source.reset(new chunked_level_map_source(file_path));
+      } else {
+        throw std::runtime_error("Unknown level extension, can't load " + file_path.filename().string());
+      }
+
+      level_map map;
+      map.set_level_source(source);
+      map.set_max_loaded_levels(prefs.max_loaded_levels);
+
+      /* Use the tileset the editor shows the map with, which goes by the
+       * name of the top left level, or the first level of the map */
+      std::string level_name;
+      for (int y = 0; y < source->get_height() && level_name.empty(); y ++) {
+        for (int x = 0; x < source->get_width() && level_name.empty(); x ++)
+          level_name = source->get_level_name(x, y);
+      }
+
+      level_renderer renderer(map, cache,
+        compose_tileset(cache, prefs.tilesets,
+                        boost::filesystem::path(level_name).filename().string()));
+      renderer.set_thread_count(thread_count);
+      renderer.set_draw_npcs(draw_npcs);
+      renderer.render(image_path);
+    } catch (const std::exception& e) {
+      std::cerr << "Could not render " << file_path.string() << ": " << e.what() << std::endl;
+      return 1;
+    }
+
+    return 0;
   }
+}
 
+int main(int argc, char* argv[]) {
   Graal::level_editor::preferences prefs;
 
   boost::filesystem::path preferences_path;
@@ -69,6 +144,20 @@ int main(int argc, char* argv[]) {
 
   prefs.load(preferences_path / "preferences");
   set_default_preferences(prefs);
+
+  // Rendering needs neither a display nor OpenGL
+  if (argc > 1 && std::strcmp(argv[1], "--render") == 0) {
+    Gtk::Main::init_gtkmm_internals();
+    return render_map(argc, argv, prefs);
+  }
+
+  Gtk::Main kit(argc, argv);
+
+  if (!gdk_gl_query()) {
+    std::cerr << "No OpenGL support" << std::endl;
+    return -1;
+  }
+
   { // destroy window before preferences get serialised
     boost::scoped_ptr<Graal::level_editor::preferences_display> prefs_display;
     boost::scoped_ptr<Graal::level_editor::window> editor;
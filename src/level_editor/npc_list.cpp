@@ -68,7 +68,8 @@ void level_editor::npc_list::on_edit_clicked() {
         display->add_undo_diff(new npc_diff(current_npc));
       }*/
       // save npc
-      current_npc = new_npc;
+      m_window.get_current_level()->update_npc(row.get_value(columns.iter), new_npc);
+      display->mark_current_level_changed();
       // TODO: this should probably not be here
       display->clear_selection();
       display->queue_draw();
@@ -107,7 +108,7 @@ void level_editor::npc_list::get() {
        iter ++) {
     Gtk::TreeModel::iterator row = m_list_store->append();
     (*row)[columns.iter] = iter;
-    (*row)[columns.image] = iter->image; // TODO: unicode
+    (*row)[columns.image] = iter->image.get_name(); // TODO: unicode
     (*row)[columns.x] = iter->get_level_x();
     (*row)[columns.y] = iter->get_level_y();
   }
@@ -0,0 +1,154 @@
+#ifndef GRAAL_LEVEL_EDITOR_OBJECT_GRID_HPP_
+#define GRAAL_LEVEL_EDITOR_OBJECT_GRID_HPP_
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace Graal {
+  /* Spatial index over rectangular level objects (links, signs). The level
+   * is divided into square cells of cell_size tiles, and every object is
+   * stored in each cell its rectangle touches, so rectangle queries only
+   * look at objects close to them.
+   * Objects are referred to by iterators into their owning std::list, which
+   * stay valid until the object is erased. Objects outside the level bounds
+   * are stored in the nearest border cells. */
+  template <typename ListT>
+  class object_grid {
+  public:
+    typedef typename ListT::iterator iterator;
+    typedef std::vector<iterator> result_type;
+
+    explicit object_grid(int cell_size = 8):
+      m_cell_size(cell_size), m_columns(0), m_rows(0) {}
+
+    /* The stored iterators belong to the copied-from lists, so copies start
+     * out empty and have to be reset and refilled by their owner */
+    object_grid(const object_grid& other):
+      m_cell_size(other.m_cell_size), m_columns(0), m_rows(0) {}
+
+    object_grid& operator=(const object_grid& other) {
+      m_cell_size = other.m_cell_size;
+      m_columns = m_rows = 0;
+      m_cells.clear();
+      m_objects.clear();
+      return *this;
+    }
+
+    // Clears the grid and sizes it for a level of the given size in tiles
+    void reset(int width, int height) {
+      m_columns = std::max(1, (width + m_cell_size - 1) / m_cell_size);
+      m_rows = std::max(1, (height + m_cell_size - 1) / m_cell_size);
+      m_cells.clear();
+      m_cells.resize(static_cast<std::size_t>(m_columns * m_rows));
+      m_objects.clear();
+    }
+
+    // Whether the grid has been sized by reset()
+    bool valid() const { return !m_cells.empty(); }
+    std::size_t size() const { return m_objects.size(); }
+
+    void insert(iterator it, int x, int y, int width, int height) {
+      entry e;
+      e.it = it;
+      e.x = x; e.y = y;
+      // Zero-size objects still occupy the tile they are placed on
+      e.width = std::max(1, width);
+      e.height = std::max(1, height);
+      get_cells(e.x, e.y, e.width, e.height, e.cells);
+
+      for (int cy = e.cells.y1; cy <= e.cells.y2; ++cy) {
+        for (int cx = e.cells.x1; cx <= e.cells.x2; ++cx) {
+          cell(cx, cy).push_back(e);
+        }
+      }
+
+      m_objects[&*it] = e.cells;
+    }
+
+    void remove(iterator it) {
+      typename object_map_type::iterator obj = m_objects.find(&*it);
+      if (obj == m_objects.end())
+        return;
+
+      const cell_range& cells = obj->second;
+      for (int cy = cells.y1; cy <= cells.y2; ++cy) {
+        for (int cx = cells.x1; cx <= cells.x2; ++cx) {
+          cell_type& c = cell(cx, cy);
+          typename cell_type::iterator iter, end = c.end();
+          for (iter = c.begin(); iter != end; ++iter) {
+            if (iter->it == it) {
+              c.erase(iter);
+              break;
+            }
+          }
+        }
+      }
+
+      m_objects.erase(obj);
+    }
+
+    // Appends all objects intersecting the given rectangle to result
+    void find(int x, int y, int width, int height, result_type& result) const {
+      if (m_cells.empty() || width <= 0 || height <= 0)
+        return;
+
+      cell_range query;
+      get_cells(x, y, width, height, query);
+
+      for (int cy = query.y1; cy <= query.y2; ++cy) {
+        for (int cx = query.x1; cx <= query.x2; ++cx) {
+          const cell_type& c = cell(cx, cy);
+          typename cell_type::const_iterator iter, end = c.end();
+          for (iter = c.begin(); iter != end; ++iter) {
+            /* Objects spanning several cells are only reported from the
+             * first cell they share with the query, so no duplicates */
+            if (cx != std::max(query.x1, iter->cells.x1) ||
+                cy != std::max(query.y1, iter->cells.y1))
+              continue;
+
+            if (iter->x < x + width && x < iter->x + iter->width &&
+                iter->y < y + height && y < iter->y + iter->height)
+              result.push_back(iter->it);
+          }
+        }
+      }
+    }
+  private:
+    struct cell_range {
+      int x1, y1, x2, y2;
+    };
+
+    struct entry {
+      iterator it;
+      int x, y, width, height;
+      cell_range cells;
+    };
+
+    typedef std::vector<entry> cell_type;
+    typedef std::map<const typename ListT::value_type*, cell_range> object_map_type;
+
+    void get_cells(int x, int y, int width, int height, cell_range& range) const {
+      range.x1 = to_cell(x, m_columns);
+      range.y1 = to_cell(y, m_rows);
+      range.x2 = to_cell(x + width - 1, m_columns);
+      range.y2 = to_cell(y + height - 1, m_rows);
+    }
+
+    int to_cell(int tile, int cell_count) const {
+      if (tile < 0)
+        return 0;
+      return std::min(cell_count - 1, tile / m_cell_size);
+    }
+
+          cell_type& cell(int cx, int cy)       { return m_cells[static_cast<std::size_t>(cx + cy * m_columns)]; }
+    const cell_type& cell(int cx, int cy) const { return m_cells[static_cast<std::size_t>(cx + cy * m_columns)]; }
+
+    int m_cell_size;
+    int m_columns, m_rows;
+    std::vector<cell_type> m_cells;
+    object_map_type m_objects;
+  };
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include <GL/glew.h>
+#include "ogl_overlay_batch.hpp"
+
+using namespace Graal::level_editor;
+
+namespace {
+  inline unsigned char to_byte(float value) {
+    if (value <= 0.0f)
+      return 0;
+    if (value >= 1.0f)
+      return 255;
+    return static_cast<unsigned char>(value * 255.0f + 0.5f);
+  }
+}
+
+ogl_overlay_batch::vertex::vertex(float _x, float _y, float r, float g, float b, float a):
+    x(_x), y(_y) {
+  color[0] = to_byte(r);
+  color[1] = to_byte(g);
+  color[2] = to_byte(b);
+  color[3] = to_byte(a);
+}
+
+ogl_overlay_batch::ogl_overlay_batch():
+  m_buffer(0), m_checked_vbo(false), m_use_vbo(false) {}
+
+void ogl_overlay_batch::add_rectangle(float x, float y, float width, float height,
+                                      float r, float g, float b, float a, bool fill) {
+  if (fill) {
+    m_fill_vertices.push_back(vertex(x, y, r, g, b, a));
+    m_fill_vertices.push_back(vertex(x + width, y, r, g, b, a));
+    m_fill_vertices.push_back(vertex(x + width, y + height, r, g, b, a));
+    m_fill_vertices.push_back(vertex(x, y + height, r, g, b, a));
+  }
+
+  add_line(x, y, x + width, y, r, g, b);
+  add_line(x + width, y, x + width, y + height, r, g, b);
+  add_line(x + width, y + height, x, y + height, r, g, b);
+  add_line(x, y + height, x, y, r, g, b);
+}
+
+void ogl_overlay_batch::add_line(float x1, float y1, float x2, float y2,
+                                 float r, float g, float b, float a) {
+  m_line_vertices.push_back(vertex(x1, y1, r, g, b, a));
+  m_line_vertices.push_back(vertex(x2, y2, r, g, b, a));
+}
+
+void ogl_overlay_batch::flush() {
+  if (empty())
+    return;
+
+  if (!m_checked_vbo) {
+    m_use_vbo = glewIsSupported("GL_ARB_vertex_buffer_object");
+    m_checked_vbo = true;
+  }
+
+  // Lines go behind the filled shapes in the same array
+  const std::size_t fill_count = m_fill_vertices.size();
+  m_fill_vertices.insert(m_fill_vertices.end(), m_line_vertices.begin(), m_line_vertices.end());
+
+  const char* base = reinterpret_cast<const char*>(&m_fill_vertices.front());
+  if (m_use_vbo) {
+    if (!m_buffer)
+      glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+    // Respecifying the whole buffer lets the driver avoid waiting for the last frame
+    glBufferData(GL_ARRAY_BUFFER,
+                 m_fill_vertices.size() * sizeof(vertex),
+                 base,
+                 GL_STREAM_DRAW);
+    base = 0;
+  }
+
+  glDisable(GL_TEXTURE_2D);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(2, GL_FLOAT, sizeof(vertex), base);
+  glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(vertex), base + 2 * sizeof(float));
+
+  if (fill_count)
+    glDrawArrays(GL_QUADS, 0, static_cast<GLsizei>(fill_count));
+
+  glLineWidth(2);
+  if (!m_line_vertices.empty())
+    glDrawArrays(GL_LINES, static_cast<GLint>(fill_count), static_cast<GLsizei>(m_line_vertices.size()));
+
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_COLOR_ARRAY);
+  if (m_use_vbo)
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glEnable(GL_TEXTURE_2D);
+
+  // The color array leaves the current color undefined
+  glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+
+  m_fill_vertices.clear();
+  m_line_vertices.clear();
+}
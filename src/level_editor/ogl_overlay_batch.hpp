@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+namespace Graal {
+namespace level_editor {
+
+/* Collects untextured rectangles and lines and draws all of them at once,
+ * filled shapes first and outlines on top. Everything is uploaded into one
+ * dynamic VBO when supported, client side arrays otherwise */
+class ogl_overlay_batch {
+public:
+  ogl_overlay_batch();
+
+  // Adds a rectangle with an opaque outline, filled with the color if fill is set
+  void add_rectangle(float x, float y, float width, float height,
+                     float r, float g, float b, float a = 1.0f, bool fill = false);
+  void add_line(float x1, float y1, float x2, float y2,
+                float r, float g, float b, float a = 1.0f);
+
+  bool empty() const { return m_fill_vertices.empty() && m_line_vertices.empty(); }
+
+  // Draws everything added since the last flush and forgets it
+  void flush();
+protected:
+  struct vertex {
+    vertex(float _x, float _y, float r, float g, float b, float a);
+    float x, y;
+    unsigned char color[4];
+  };
+
+  std::vector<vertex> m_fill_vertices;
+  std::vector<vertex> m_line_vertices;
+
+  unsigned int m_buffer;
+  bool m_checked_vbo, m_use_vbo;
+};
+
+}
+}
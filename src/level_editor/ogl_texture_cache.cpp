@@ -4,10 +4,21 @@
 #include <GL/glew.h>
 #include <gtkmm.h>
 
+#include <algorithm>
+#include <stdexcept>
+
 
 using namespace Graal::level_editor;
 
-ogl_texture_cache::ogl_texture_cache(image_cache& cache): m_image_cache(cache) {
+namespace {
+  // Atlas pages are this big unless the OpenGL implementation can't do it
+  const int max_atlas_size = 1024;
+  // Transparent pixels between packed images so filtering doesn't mix them
+  const int atlas_padding = 1;
+}
+
+ogl_texture_cache::ogl_texture_cache(image_cache& cache):
+    m_image_cache(cache), m_atlas_size(0) {
   cache.signal_cache_update().connect(
       sigc::mem_fun(this, &ogl_texture_cache::on_cache_updated));
 }
@@ -21,6 +32,15 @@ void ogl_texture_cache::on_cache_updated() {
   }
 
   m_textures.clear();
+  m_handle_textures.clear();
+
+  std::vector<atlas_page>::iterator page, pages_end = m_atlas_pages.end();
+  for (page = m_atlas_pages.begin(); page != pages_end; ++page) {
+    glDeleteTextures(1, &page->index);
+  }
+
+  m_atlas_pages.clear();
+  m_handle_atlas_textures.clear();
 }
 
 const texture_info& ogl_texture_cache::get_texture(const std::string& file_name) {
@@ -35,3 +55,107 @@ const texture_info& ogl_texture_cache::get_texture(const std::string& file_name)
 
   return m_textures[file_name];
 }
+
+const texture_info& ogl_texture_cache::get_texture(const Graal::image_handle& image) {
+  const std::size_t id = image.get_id();
+  if (id >= m_handle_textures.size()) {
+    texture_info empty_info = texture_info();
+    m_handle_textures.resize(id + 1, empty_info);
+  }
+
+  texture_info& tinfo = m_handle_textures[id];
+  if (!tinfo.index)
+    tinfo = get_texture(image.get_name());
+  return tinfo;
+}
+
+const texture_info& ogl_texture_cache::get_atlas_texture(const Graal::image_handle& image) {
+  const std::size_t id = image.get_id();
+  if (id >= m_handle_atlas_textures.size()) {
+    texture_info empty_info = texture_info();
+    m_handle_atlas_textures.resize(id + 1, empty_info);
+  }
+
+  texture_info& tinfo = m_handle_atlas_textures[id];
+  if (!tinfo.index) {
+    if (!m_atlas_size) {
+      GLint max_size = 0;
+      glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+      m_atlas_size = std::min(max_atlas_size, static_cast<int>(max_size));
+    }
+
+    // Big images would leave most of a page empty
+    Cairo::RefPtr<Cairo::ImageSurface>& surface = m_image_cache.get_image(image);
+    if (surface->get_width() > m_atlas_size / 2 || surface->get_height() > m_atlas_size / 2)
+      tinfo = get_texture(image);
+    else
+      tinfo = pack(surface);
+  }
+  return tinfo;
+}
+
+texture_info ogl_texture_cache::pack(const Cairo::RefPtr<Cairo::ImageSurface>& surface) {
+  const int width = surface->get_width();
+  const int height = surface->get_height();
+
+  // Start a new row if the image doesn't fit into the current one
+  atlas_page* page = m_atlas_pages.empty() ? 0 : &m_atlas_pages.back();
+  if (page && page->row_x + width > m_atlas_size) {
+    page->row_x = 0;
+    page->row_y += page->row_height;
+    page->row_height = 0;
+  }
+
+  // And a new page if there's no room for another row
+  if (!page || page->row_y + height > m_atlas_size) {
+    atlas_page new_page;
+    new_page.row_x = new_page.row_y = new_page.row_height = 0;
+
+    glEnable(GL_TEXTURE_2D);
+    glGenTextures(1, &new_page.index);
+    if (!new_page.index)
+      throw std::runtime_error("Failed to allocate OpenGL texture");
+
+    glBindTexture(GL_TEXTURE_2D, new_page.index);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    // Unused parts have to be transparent for the padding to work
+    std::vector<unsigned char> empty(static_cast<std::size_t>(m_atlas_size * m_atlas_size * 4), 0);
+    glTexImage2D(GL_TEXTURE_2D,
+      0, GL_RGBA,
+      m_atlas_size, m_atlas_size,
+      0, GL_BGRA, GL_UNSIGNED_BYTE,
+      &empty.front());
+
+    m_atlas_pages.push_back(new_page);
+    page = &m_atlas_pages.back();
+  }
+
+  glBindTexture(GL_TEXTURE_2D, page->index);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, surface->get_stride() / 4);
+  glTexSubImage2D(GL_TEXTURE_2D,
+    0, page->row_x, page->row_y,
+    width, height,
+    GL_BGRA, GL_UNSIGNED_BYTE,
+    surface->get_data());
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  const float size = static_cast<float>(m_atlas_size);
+  texture_info tinfo;
+  tinfo.index = page->index;
+  tinfo.x = page->row_x / size;
+  tinfo.y = page->row_y / size;
+  tinfo.width = width / size;
+  tinfo.height = height / size;
+  tinfo.image_width = width;
+  tinfo.image_height = height;
+
+  page->row_x += width + atlas_padding;
+  page->row_height = std::max(page->row_height, height + atlas_padding);
+
+  return tinfo;
+}
@@ -4,15 +4,19 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 namespace Graal {
 namespace level_editor {
 
 /* Contains everything required to draw a texture:
- * width, height: the correct u, v corrdinates to use [0, 1]
+ * x, y: the u, v coordinates of the image's top left corner
+ * width, height: the correct u, v corrdinates to use [0, 1], relative to x, y
  * image_width, image_height: the actual size of the original image in pixel
  */
 struct texture_info {
+  float x;
+  float y;
   float width;
   float height;
   unsigned int index;
@@ -23,15 +27,41 @@ struct texture_info {
 class ogl_texture_cache {
 public:
   typedef std::map<std::string, texture_info> texture_map_type;
+  typedef std::vector<texture_info> texture_handle_list_type;
 
   ogl_texture_cache(image_cache& cache);
 
   const texture_info& get_texture(const std::string& file_name);
+  // Same as above, but looks the texture up by handle after the first call
+  const texture_info& get_texture(const image_handle& image);
+
+  /* Returns the image packed into an atlas texture shared with other
+   * images, so drawing them doesn't need texture switches. Images too big
+   * for an atlas page get their own texture */
+  const texture_info& get_atlas_texture(const image_handle& image);
 protected:
   void on_cache_updated();
 
+  // A texture images get packed into row by row
+  struct atlas_page {
+    unsigned int index;
+    // Where the next image goes and the height of the current row
+    int row_x, row_y, row_height;
+  };
+
+  // Copies the surface into an atlas page, starting a new page if it's full
+  texture_info pack(const Cairo::RefPtr<Cairo::ImageSurface>& surface);
+
   image_cache& m_image_cache;
   texture_map_type m_textures;
+  // Copies of the textures in m_textures by handle id, index 0 if not loaded
+  texture_handle_list_type m_handle_textures;
+
+  std::vector<atlas_page> m_atlas_pages;
+  // Atlas textures by handle id, index 0 if not packed yet
+  texture_handle_list_type m_handle_atlas_textures;
+  // Width and height of atlas pages, 0 until the first one is made
+  int m_atlas_size;
 };
 
 }
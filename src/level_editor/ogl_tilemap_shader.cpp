@@ -0,0 +1,150 @@
+#include <GL/glew.h>
+#include "ogl_tilemap_shader.hpp"
+
+#include <iostream>
+#include <vector>
+
+using namespace Graal::level_editor;
+
+namespace {
+  const char vertex_source[] =
+    "void main() {\n"
+    "  gl_Position = ftransform();\n"
+    "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "  gl_FrontColor = gl_Color;\n"
+    "}\n";
+
+  // Only GLSL 1.10 and 8 bit textures so it runs on old and software drivers
+  const char fragment_source[] =
+    "uniform sampler2D tileset;\n"
+    "uniform sampler2D tiles;\n"
+    "uniform vec2 tile_size;\n"
+    "uniform vec2 level_size;\n"
+    "void main() {\n"
+    "  vec2 pos = gl_TexCoord[0].st;\n"
+    "  vec4 t = texture2D(tiles, (floor(pos) + 0.5) / level_size);\n"
+    "  if (t.a < 0.5)\n"
+    "    discard;\n"
+    "  vec2 cell = floor(t.rg * 255.0 + 0.5);\n"
+    "  gl_FragColor = texture2D(tileset, (cell + fract(pos)) * tile_size) * gl_Color;\n"
+    "}\n";
+}
+
+ogl_tilemap_shader::ogl_tilemap_shader():
+  m_program(0),
+  m_tileset_location(-1), m_tiles_location(-1),
+  m_tile_size_location(-1), m_level_size_location(-1) {}
+
+unsigned int ogl_tilemap_shader::compile(unsigned int type, const char* source) {
+  GLuint shader = glCreateShader(type);
+  if (!shader)
+    return 0;
+
+  glShaderSource(shader, 1, &source, 0);
+  glCompileShader(shader);
+
+  GLint status = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status != GL_TRUE) {
+    GLint length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    std::vector<char> log(static_cast<std::size_t>(length) + 1);
+    glGetShaderInfoLog(shader, length, 0, &log.front());
+    std::cerr << "ogl_tilemap_shader: compiling failed: " << &log.front() << std::endl;
+
+    glDeleteShader(shader);
+    return 0;
+  }
+
+  return shader;
+}
+
+bool ogl_tilemap_shader::init() {
+  if (m_program)
+    return true;
+
+  if (!GLEW_VERSION_2_0) {
+    std::cerr << "ogl_tilemap_shader::init: no OpenGL 2.0 support, drawing tiles without shaders" << std::endl;
+    return false;
+  }
+
+  GLuint vertex_shader = compile(GL_VERTEX_SHADER, vertex_source);
+  GLuint fragment_shader = compile(GL_FRAGMENT_SHADER, fragment_source);
+
+  GLuint program = 0;
+  if (vertex_shader && fragment_shader) {
+    program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+      std::cerr << "ogl_tilemap_shader::init: linking failed" << std::endl;
+      glDeleteProgram(program);
+      program = 0;
+    }
+  }
+
+  // The program keeps the shaders alive as long as it needs them
+  if (vertex_shader)
+    glDeleteShader(vertex_shader);
+  if (fragment_shader)
+    glDeleteShader(fragment_shader);
+
+  if (!program)
+    return false;
+
+  m_program = program;
+  m_tileset_location = glGetUniformLocation(m_program, "tileset");
+  m_tiles_location = glGetUniformLocation(m_program, "tiles");
+  m_tile_size_location = glGetUniformLocation(m_program, "tile_size");
+  m_level_size_location = glGetUniformLocation(m_program, "level_size");
+
+  return true;
+}
+
+void ogl_tilemap_shader::enable(float tile_u, float tile_v, int level_width, int level_height) {
+  glUseProgram(m_program);
+  glUniform1i(m_tileset_location, 0);
+  glUniform1i(m_tiles_location, 1);
+  glUniform2f(m_tile_size_location, tile_u, tile_v);
+  glUniform2f(m_level_size_location,
+    static_cast<float>(level_width), static_cast<float>(level_height));
+}
+
+void ogl_tilemap_shader::disable() {
+  glUseProgram(0);
+}
+
+unsigned int ogl_tilemap_shader::create_tile_texture(int width, int height) {
+  GLuint texture = 0;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+
+  // Texels are looked up exactly, never filtered
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+  std::vector<texel> texels(static_cast<std::size_t>(width * height));
+  glTexImage2D(GL_TEXTURE_2D,
+    0, GL_RGBA,
+    width, height,
+    0, GL_RGBA, GL_UNSIGNED_BYTE,
+    &texels.front());
+
+  return texture;
+}
+
+void ogl_tilemap_shader::update_tile_texture(unsigned int texture, int y, int width, int height, const texel* texels) {
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D,
+    0, 0, y,
+    width, height,
+    GL_RGBA, GL_UNSIGNED_BYTE,
+    texels);
+}
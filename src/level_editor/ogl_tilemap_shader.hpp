@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+
+namespace Graal {
+namespace level_editor {
+
+/* GLSL program drawing a whole tile layer as a single quad. The tiles come
+ * from a tile texture with one texel per tile, holding the tileset column
+ * and row of the tile in red and green and whether it is drawn in alpha.
+ * The quad's texture coordinates are tile positions, (0, 0) to
+ * (level width, level height) */
+class ogl_tilemap_shader {
+public:
+  // One texel of a tile texture
+  struct texel {
+    texel(): column(0), row(0), unused(0), drawn(0) {}
+    unsigned char column, row, unused, drawn;
+  };
+
+  ogl_tilemap_shader();
+
+  /* Compiles and links the program, returns false if the OpenGL
+   * implementation has no shader support or building it failed */
+  bool init();
+  bool is_initialized() const { return m_program != 0; }
+
+  /* Uses the program with the tileset bound to texture unit 0 and the tile
+   * texture to unit 1. tile_u, tile_v are the size of a tile in tileset
+   * texture coordinates */
+  void enable(float tile_u, float tile_v, int level_width, int level_height);
+  void disable();
+
+  // Returns a new tile texture of width x height tiles with nothing drawn
+  static unsigned int create_tile_texture(int width, int height);
+  // Uploads rows y to y + height of a tile texture
+  static void update_tile_texture(unsigned int texture, int y, int width, int height, const texel* texels);
+protected:
+  unsigned int compile(unsigned int type, const char* source);
+
+  unsigned int m_program;
+  int m_tileset_location, m_tiles_location;
+  int m_tile_size_location, m_level_size_location;
+};
+
+}
+}
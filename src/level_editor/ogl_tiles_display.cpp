@@ -1,5 +1,7 @@
 #include "ogl_tiles_display.hpp"
 #include "helper.hpp"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <boost/format.hpp>
 
@@ -46,6 +48,7 @@ texture_info Graal::level_editor::load_texture_from_surface(Cairo::RefPtr<Cairo:
 
   texture_info info;
   info.index = id;
+  info.x = info.y = 0.0f;
 
   unsigned int width, height;
   info.image_width = width = surface->get_width();
@@ -113,7 +116,12 @@ ogl_tiles_display::ogl_tiles_display():
   m_hadjustment(0),
   m_vadjustment(0),
   m_tile_width(16), // TODO: take a parameter for this?
-  m_tile_height(16)
+  m_tile_height(16),
+  m_zoom(1.0),
+  m_tile_opacity_columns(0),
+  m_tile_opacity_rows(0),
+  m_tileset_generation(0),
+  m_frame_pending(false)
 {
   m_tileset.index = 0;
   /* Set up for custom scrolling handling. GTK does this in a pretty terrible
@@ -158,6 +166,8 @@ ogl_tiles_display::ogl_tiles_display():
 
   // Make it possible to grab focus
   property_can_focus().set_value(true);
+
+  m_frame_timer.start();
 }
 
 bool ogl_tiles_display::on_gl_configure_event(GdkEventConfigure*) {
@@ -230,7 +240,7 @@ void ogl_tiles_display::on_gl_realize() {
 void ogl_tiles_display::draw_all() {
   glEnable(GL_TEXTURE_2D);
   glBindTexture(GL_TEXTURE_2D, m_tileset.index);
-  tile_buf& buf = get_tile_buf();
+  const tile_buf& buf = get_tile_buf();
   const int width = buf.get_width();
   const int height = buf.get_height();
 
@@ -244,17 +254,11 @@ void ogl_tiles_display::draw_all() {
 }
 
 void ogl_tiles_display::draw_tile(const tile& _tile, int x, int y) {
-  // The position of the actual tile inside the tileset
-  const int tx = helper::get_tile_x(_tile.index);
-  const int ty = helper::get_tile_y(_tile.index);
+  const tile_uv uv = get_tile_uv(_tile.index);
+  const float x1 = uv.x1, y1 = uv.y1, x2 = uv.x2, y2 = uv.y2;
 
-  // Build texture coordinates
   int dx = x * m_tile_width;
   int dy = y * m_tile_height;
-  float x1 = static_cast<float>(tx * m_tile_width)/m_tileset.image_width * m_tileset.width;
-  float x2 = static_cast<float>((tx+1)*m_tile_width)/m_tileset.image_width * m_tileset.width;
-  float y1 = static_cast<float>(ty*m_tile_height)/m_tileset.image_height * m_tileset.height;
-  float y2 = static_cast<float>((ty+1)*m_tile_height)/m_tileset.image_height * m_tileset.height;
 
   //glBegin(GL_QUADS);
     // Top left
@@ -276,11 +280,143 @@ void ogl_tiles_display::load_tileset(Cairo::RefPtr<Cairo::ImageSurface>& surface
   glEnable(GL_TEXTURE_2D);
 
   m_tileset = load_texture_from_surface(surface, m_tileset.index);
+  classify_tileset(surface);
+  build_tile_uvs();
   
   invalidate();
 }
 
+void ogl_tiles_display::classify_tileset(const Cairo::RefPtr<Cairo::ImageSurface>& surface) {
+  ++m_tileset_generation;
+  m_tile_opacity.clear();
+  m_tile_colors.clear();
+  m_tile_opacity_columns = m_tile_opacity_rows = 0;
+
+  if (m_tile_width <= 0 || m_tile_height <= 0)
+    return;
+
+  m_tile_opacity_columns = surface->get_width() / m_tile_width;
+  m_tile_opacity_rows = surface->get_height() / m_tile_height;
+  m_tile_opacity.resize(
+    static_cast<std::size_t>(m_tile_opacity_columns * m_tile_opacity_rows), tile_opaque);
+  m_tile_colors.resize(m_tile_opacity.size(), 0);
+
+  surface->flush();
+  const unsigned char* data = surface->get_data();
+  const int stride = surface->get_stride();
+  const bool has_alpha = surface->get_format() == Cairo::FORMAT_ARGB32;
+
+  // Colors are only known for 32 bit pixels, alpha is always opaque for RGB24
+  if (has_alpha || surface->get_format() == Cairo::FORMAT_RGB24) {
+    for (int ty = 0; ty < m_tile_opacity_rows; ++ty) {
+      for (int tx = 0; tx < m_tile_opacity_columns; ++tx) {
+        // Sum up every channel
+        guint32 sums[4] = {0, 0, 0, 0};
+        for (int y = 0; y < m_tile_height; ++y) {
+          const guint32* pixels = reinterpret_cast<const guint32*>(
+            data + (ty * m_tile_height + y) * stride) + tx * m_tile_width;
+          for (int x = 0; x < m_tile_width; ++x) {
+            const guint32 pixel = has_alpha ? pixels[x] : (pixels[x] | 0xff000000);
+            for (int channel = 0; channel < 4; ++channel)
+              sums[channel] += (pixel >> (channel * 8)) & 0xff;
+          }
+        }
+
+        const guint32 pixel_count = static_cast<guint32>(m_tile_width * m_tile_height);
+        guint32 color = 0;
+        for (int channel = 0; channel < 4; ++channel)
+          color |= (sums[channel] / pixel_count) << (channel * 8);
+        m_tile_colors[static_cast<std::size_t>(tx + ty * m_tile_opacity_columns)] = color;
+      }
+    }
+  }
+
+  // Without an alpha channel everything is opaque
+  if (!has_alpha)
+    return;
+
+  for (int ty = 0; ty < m_tile_opacity_rows; ++ty) {
+    for (int tx = 0; tx < m_tile_opacity_columns; ++tx) {
+      // ARGB32 pixels are native endian 32 bit values with alpha on top
+      guint32 min_alpha = 0xff, max_alpha = 0;
+      for (int y = 0; y < m_tile_height && (min_alpha == 0xff || max_alpha == 0); ++y) {
+        const guint32* pixels = reinterpret_cast<const guint32*>(
+          data + (ty * m_tile_height + y) * stride) + tx * m_tile_width;
+        for (int x = 0; x < m_tile_width; ++x) {
+          const guint32 alpha = pixels[x] >> 24;
+          min_alpha = std::min(min_alpha, alpha);
+          max_alpha = std::max(max_alpha, alpha);
+        }
+      }
+
+      tile_opacity opacity = tile_partial;
+      if (min_alpha == 0xff)
+        opacity = tile_opaque;
+      else if (max_alpha == 0)
+        opacity = tile_empty;
+      m_tile_opacity[static_cast<std::size_t>(tx + ty * m_tile_opacity_columns)] = opacity;
+    }
+  }
+}
+
+namespace {
+  // Tile indices are stored as two base64 digits in level files
+  const int tile_index_count = 64 * 64;
+}
+
+void ogl_tiles_display::build_tile_uvs() {
+  m_tile_uvs.resize(tile_index_count);
+  for (int i = 0; i < tile_index_count; ++i) {
+    m_tile_uvs[static_cast<std::size_t>(i)] = calculate_tile_uv(i);
+  }
+}
+
+ogl_tiles_display::tile_uv ogl_tiles_display::calculate_tile_uv(int index) const {
+  // The position of the actual tile inside the tileset
+  const int tx = helper::get_tile_x(index);
+  const int ty = helper::get_tile_y(index);
+
+  tile_uv uv;
+  uv.x1 = static_cast<float>(tx * m_tile_width)/m_tileset.image_width * m_tileset.width;
+  uv.x2 = static_cast<float>((tx+1)*m_tile_width)/m_tileset.image_width * m_tileset.width;
+  uv.y1 = static_cast<float>(ty*m_tile_height)/m_tileset.image_height * m_tileset.height;
+  uv.y2 = static_cast<float>((ty+1)*m_tile_height)/m_tileset.image_height * m_tileset.height;
+  return uv;
+}
+
+ogl_tiles_display::tile_opacity ogl_tiles_display::get_tile_opacity(const tile& _tile) const {
+  if (_tile == tile_transparent)
+    return tile_empty;
+  if (_tile.index < 0)
+    return tile_partial;
+
+  const int tx = helper::get_tile_x(_tile.index);
+  const int ty = helper::get_tile_y(_tile.index);
+  if (tx >= m_tile_opacity_columns || ty >= m_tile_opacity_rows)
+    return tile_partial;
+
+  return static_cast<tile_opacity>(
+    m_tile_opacity[static_cast<std::size_t>(tx + ty * m_tile_opacity_columns)]);
+}
+
+guint32 ogl_tiles_display::get_tile_color(const tile& _tile) const {
+  if (_tile == tile_transparent || _tile.index < 0)
+    return 0;
+
+  const int tx = helper::get_tile_x(_tile.index);
+  const int ty = helper::get_tile_y(_tile.index);
+  if (tx >= m_tile_opacity_columns || ty >= m_tile_opacity_rows)
+    return 0;
+
+  return m_tile_colors[static_cast<std::size_t>(tx + ty * m_tile_opacity_columns)];
+}
+
 bool ogl_tiles_display::on_gl_expose_event(GdkEventExpose*) {
+  // Anything invalidated from now on needs another frame
+  m_frame_pending = false;
+  m_connection_frame.disconnect();
+  m_frame_timer.reset();
+
   if (!make_current()) {
     return false;
   }
@@ -329,14 +465,60 @@ bool ogl_tiles_display::on_gl_expose_event(GdkEventExpose*) {
   return true;
 }
 
+namespace {
+  // There's no way to ask GTK for the refresh rate, so assume 60Hz
+  const double frame_interval = 1.0 / 60;
+}
+
 void ogl_tiles_display::invalidate() {
-  queue_draw();
+  // The pending frame draws this change as well
+  if (m_frame_pending)
+    return;
+  // Showing the widget again draws everything anyway
+  if (!is_drawable())
+    return;
+  m_frame_pending = true;
+
+  const double elapsed = m_frame_timer.elapsed();
+  if (elapsed >= frame_interval) {
+    queue_draw();
+  } else {
+    m_connection_frame = Glib::signal_timeout().connect(
+      sigc::mem_fun(*this, &ogl_tiles_display::on_frame_timeout),
+      static_cast<unsigned int>((frame_interval - elapsed) * 1000) + 1);
+  }
   //get_window()->invalidate_rect(get_allocation(), false);
 }
 
+bool ogl_tiles_display::on_frame_timeout() {
+  queue_draw();
+  return false;
+}
+
+void ogl_tiles_display::on_unmap() {
+  m_frame_pending = false;
+  m_connection_frame.disconnect();
+  GLArea::on_unmap();
+}
+
+void ogl_tiles_display::on_unrealize() {
+  m_frame_pending = false;
+  m_connection_frame.disconnect();
+  GLArea::on_unrealize();
+}
+
 void ogl_tiles_display::set_tile_size(int tile_width, int tile_height) {
   m_tile_width = tile_width;
   m_tile_height = tile_height;
+
+  // The classification is per tile, so forget it until the next tileset
+  ++m_tileset_generation;
+  m_tile_opacity.clear();
+  m_tile_colors.clear();
+  m_tile_opacity_columns = m_tile_opacity_rows = 0;
+
+  if (m_tileset.index)
+    build_tile_uvs();
   
   invalidate();
 }
@@ -363,8 +545,8 @@ void ogl_tiles_display::clear() {
   set_surface_size();
 }
 
-void ogl_tiles_display::set_tile_buf(tile_buf& buf) {
-  m_tile_buf.swap(buf);
+void ogl_tiles_display::set_tile_buf(BOOST_RV_REF(tile_buf) buf) {
+  m_tile_buf = boost::move(buf);
   set_surface_size();
 }
 
@@ -407,8 +589,14 @@ void ogl_tiles_display::get_cursor_position(int& x, int& y) {
   int ox, oy;
   get_scroll_offset(ox, oy);
 
-  x += ox;
-  y += oy;
+  // The scroll offset is in screen pixels
+  x = static_cast<int>(std::floor((x + ox) / m_zoom));
+  y = static_cast<int>(std::floor((y + oy) / m_zoom));
+}
+
+void ogl_tiles_display::set_zoom(double zoom) {
+  m_zoom = zoom;
+  set_surface_size();
 }
 
 void ogl_tiles_display::get_cursor_tiles_position(int& x, int& y) {
@@ -12,6 +12,8 @@
 #include "level.hpp"
 #include "ogl_texture_cache.hpp"
 
+#include <vector>
+
 namespace Graal {
 namespace level_editor {
 
@@ -29,8 +31,10 @@ public:
   void clear();
 
   virtual tile_buf& get_tile_buf() { return m_tile_buf; }
-  void set_tile_buf(tile_buf& buf);
+  void set_tile_buf(BOOST_RV_REF(tile_buf) buf);
 
+  /* Schedules a redraw. Redraws are coalesced, at most one is done per
+   * display refresh */
   void invalidate();
 
   void set_adjustments(Gtk::Adjustment* hadjustment, Gtk::Adjustment* vadjustment);
@@ -49,6 +53,37 @@ public:
   // Return the cursor position in tiles rounded down
   void get_cursor_tiles_position(int& x, int& y);
 
+  // Screen pixels per tileset pixel
+  double get_zoom() const { return m_zoom; }
+  void set_zoom(double zoom);
+
+  // How much of the tiles below a tile is hidden by it
+  enum tile_opacity {
+    tile_empty,   // no visible pixels
+    tile_partial, // some pixels are (partially) transparent
+    tile_opaque   // hides the tiles below completely
+  };
+
+  /* Returns the opacity of the tile in the current tileset, tile_partial
+   * if the tile isn't known */
+  tile_opacity get_tile_opacity(const tile& _tile) const;
+
+  /* Returns the average color of the tile as premultiplied ARGB, 0 for
+   * tiles that aren't known */
+  guint32 get_tile_color(const tile& _tile) const;
+
+  // Texture coordinates of a tile in the tileset texture
+  struct tile_uv {
+    float x1, y1, x2, y2;
+  };
+
+  // Returns the texture coordinates of the tile index in the current tileset
+  tile_uv get_tile_uv(int index) const {
+    if (index >= 0 && static_cast<std::size_t>(index) < m_tile_uvs.size())
+      return m_tile_uvs[static_cast<std::size_t>(index)];
+    return calculate_tile_uv(index);
+  }
+
 protected:
   Gtk::Adjustment* m_hadjustment;
   Gtk::Adjustment* m_vadjustment;
@@ -61,11 +96,40 @@ protected:
   virtual void draw_all();
 
   void load_tileset(Cairo::RefPtr<Cairo::ImageSurface>& surface);
+  /* Determines the opacity of every tile of the tileset by its alpha channel
+   * and its average color */
+  void classify_tileset(const Cairo::RefPtr<Cairo::ImageSurface>& surface);
+  // Fills the texture coordinate table for the current tileset and tile size
+  void build_tile_uvs();
+  tile_uv calculate_tile_uv(int index) const;
 
   sigc::connection m_connection_idle;
 
+  // Queues the redraw delayed by invalidate
+  bool on_frame_timeout();
+  // Hidden widgets get no expose event, so drop the pending frame
+  virtual void on_unmap();
+  virtual void on_unrealize();
+  sigc::connection m_connection_frame;
+  // Time since the last frame was drawn
+  Glib::Timer m_frame_timer;
+  // A redraw has been requested but not been drawn yet
+  bool m_frame_pending;
+
   texture_info m_tileset;
   int m_tile_width, m_tile_height;
+  double m_zoom;
+
+  // tile_opacity of every tile in the tileset, by tileset position
+  std::vector<unsigned char> m_tile_opacity;
+  int m_tile_opacity_columns, m_tile_opacity_rows;
+  // Average color of every tile, same layout as m_tile_opacity
+  std::vector<guint32> m_tile_colors;
+  // Changes whenever the tile opacities change
+  unsigned int m_tileset_generation;
+
+  // tile_uv of every tile index that fits into a level file
+  std::vector<tile_uv> m_tile_uvs;
 
   tile_buf m_tile_buf;
 
@@ -72,7 +72,10 @@ namespace {
 }
 
 preferences::preferences():
-  use_graal_cache(false)
+  use_graal_cache(false),
+  max_loaded_levels(64),
+  intern_tile_rows(true),
+  use_tile_shader(true)
 {
 }
 
@@ -96,6 +99,14 @@ void preferences::serialize() {
   m_values["use_graal_cache"]
     = use_graal_cache ? "true" : "false";
 
+  m_values["max_loaded_levels"] = boost::lexical_cast<std::string>(max_loaded_levels);
+
+  m_values["intern_tile_rows"]
+    = intern_tile_rows ? "true" : "false";
+
+  m_values["use_tile_shader"]
+    = use_tile_shader ? "true" : "false";
+
   if (default_tile == -1) { // TODO: see window.cpp TODO re this
     m_values.erase("default_tile");
   } else {
@@ -156,6 +167,24 @@ void preferences::deserialize() {
   hide_signs = false;
   hide_links = false;
 
+  iter = m_values.find("max_loaded_levels");
+  if (iter != m_values.end()) {
+    std::istringstream ss(iter->second);
+    ss >> max_loaded_levels;
+    // Keep at least the levels around the current one
+    max_loaded_levels = std::max(9, max_loaded_levels);
+  }
+
+  iter = m_values.find("intern_tile_rows");
+  if (iter != m_values.end()) {
+    intern_tile_rows = (iter->second == "true");
+  }
+
+  iter = m_values.find("use_tile_shader");
+  if (iter != m_values.end()) {
+    use_tile_shader = (iter->second == "true");
+  }
+
   default_tile = -1; // TODO: see window.cpp TODO re. this
   iter = m_values.find("default_tile");
   if (iter != m_values.end()) {
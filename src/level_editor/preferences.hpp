@@ -28,6 +28,12 @@ namespace Graal {
       bool fade_layers;
       bool remember_default_tile;
       bool use_graal_cache;
+      // Amount of levels a GMap keeps loaded before unloading unchanged ones
+      int max_loaded_levels;
+      // Share equal tile rows between loaded levels
+      bool intern_tile_rows;
+      // Draw tile layers with a GLSL program if the OpenGL driver supports it
+      bool use_tile_shader;
 
       tileset add_tileset(const std::string& name, const std::string& prefix);
       tileset add_tileset(const std::string& name, const std::string& prefix, int x, int y, bool main = false);
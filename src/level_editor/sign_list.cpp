@@ -105,7 +105,8 @@ void level_editor::sign_list::on_create_clicked() {
   new_sign.x = helper::bound_by(new_sign.x, 0, level.get_width());
   new_sign.y = helper::bound_by(new_sign.y, 0, level.get_height());
 
-  m_window.get_current_level()->signs.push_back(new_sign);
+  level.add_sign(new_sign);
+  m_window.get_current_level_display()->mark_current_level_changed();
   get();
   
   // select the last item and scroll to it
@@ -120,7 +121,8 @@ void level_editor::sign_list::on_delete_clicked() {
   Gtk::TreeModel::iterator iter = selection->get_selected();
   if (iter) {
     Gtk::TreeRow row = *iter;
-    m_window.get_current_level()->signs.erase(row.get_value(columns.iter));
+    m_window.get_current_level()->delete_sign(row.get_value(columns.iter));
+    m_window.get_current_level_display()->mark_current_level_changed();
     get();
     m_window.get_current_level_display()->queue_draw();
   }
@@ -154,17 +156,21 @@ void level_editor::sign_list::get() {
 }
 
 void level_editor::sign_list::set() {
+  Graal::level& current_level = *m_window.get_current_level();
   Gtk::TreeIter iter, end;
   end = m_list_store->children().end();
   for (iter = m_list_store->children().begin();
        iter != end;
        iter ++) {
-    sign& _sign = *iter->get_value(columns.iter);
-    _sign.x = iter->get_value(columns.x);
-    _sign.y = iter->get_value(columns.y);
-    _sign.text = iter->get_value(columns.text);
+    level::sign_list_type::iterator sign_iter = iter->get_value(columns.iter);
+    sign new_sign;
+    new_sign.x = iter->get_value(columns.x);
+    new_sign.y = iter->get_value(columns.y);
+    new_sign.text = iter->get_value(columns.text);
+    current_level.update_sign(sign_iter, new_sign);
   }
 
+  m_window.get_current_level_display()->mark_current_level_changed();
   m_window.get_current_level_display()->queue_draw();
 }
 
@@ -162,7 +162,7 @@ void level_editor::tile_objects_display::on_object_changed() {
   }
 
   tile_buf tiles = object_group[m_objects.get_active_text()];
-  m_display.set_tile_buf(tiles);
+  m_display.set_tile_buf(boost::move(tiles));
 }
 
 void level_editor::tile_objects_display::on_mouse_pressed(GdkEventButton*) {
@@ -11,8 +11,8 @@ namespace Graal {
     public:
       virtual tile_buf& get_tile_buf() { return m_tile_buf; }
 
-      void set_tile_buf(tile_buf& buf) {
-        m_tile_buf.swap(buf);
+      void set_tile_buf(BOOST_RV_REF(tile_buf) buf) {
+        m_tile_buf = boost::move(buf);
         set_surface_buffers();
         update_all();
         queue_draw();
@@ -42,14 +42,15 @@ void level_editor::tileset_display::set_tile_size(int tile_width, int tile_heigh
   m_tile_height = tile_height;
 }
 
-void level_editor::tileset_display::update_tileset(const std::string& level_name) {
+Cairo::RefPtr<Cairo::ImageSurface> level_editor::compose_tileset(
+    image_cache& cache, tileset_list_type& tilesets, const std::string& level_name) {
   // find the main tileset and draw it first, then the others
   level_editor::tileset_list_type::iterator main_iter;
   level_editor::tileset_list_type::iterator iter, end;
-  end = m_preferences.tilesets.end();
-  main_iter = m_preferences.tilesets.end();
+  end = tilesets.end();
+  main_iter = tilesets.end();
 
-  for (iter = m_preferences.tilesets.begin();
+  for (iter = tilesets.begin();
        iter != end;
        iter ++) {
     // prefix matches level name
@@ -62,34 +63,35 @@ void level_editor::tileset_display::update_tileset(const std::string& level_name
   }
   
   Cairo::RefPtr<Cairo::ImageSurface> main;
-  if (main_iter == m_preferences.tilesets.end()) {
+  if (main_iter == tilesets.end()) {
     // No matching main tileset, use default image and display error
     // TODO: actually display an error box here
     //std::cerr <<
     //  "No valid tileset found, please add atleast one main tileset to the "
     //  "tileset list that matches the current level." << std::endl;
-    main = m_image_cache.get_image("internal/no_img.png");
+    main = cache.get_image("internal/no_img.png");
   } else {
-    main = m_image_cache.get_image(main_iter->name);
+    main = cache.get_image(main_iter->name);
   }
   //std::cout << "creating surface" << std::endl;
   const int main_width = main->get_width();
   const int main_height = main->get_height();
-  m_surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, main_width, main_height);
+  Cairo::RefPtr<Cairo::ImageSurface> surface =
+    Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, main_width, main_height);
 
-  Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(m_surface);
+  Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(surface);
 
   cr->set_source(main, 0, 0);
   cr->paint();
 
   // now draw the rest
-  end = m_preferences.tilesets.end();
-  for (iter = m_preferences.tilesets.begin();
+  end = tilesets.end();
+  for (iter = tilesets.begin();
        iter != end;
        iter ++) {
     // prefix matches level name
     if (level_name.find(iter->prefix) != std::string::npos && !iter->main) {
-      Cairo::RefPtr<Cairo::ImageSurface> ts = m_image_cache.get_image(iter->name);
+      Cairo::RefPtr<Cairo::ImageSurface> ts = cache.get_image(iter->name);
       // Ignore other matching main tilesets
       if (!iter->main && iter->active) {
         cr->set_source(ts, iter->x, iter->y);
@@ -98,6 +100,14 @@ void level_editor::tileset_display::update_tileset(const std::string& level_name
     }
   }
 
+  return surface;
+}
+
+void level_editor::tileset_display::update_tileset(const std::string& level_name) {
+  m_surface = compose_tileset(m_image_cache, m_preferences.tilesets, level_name);
+
+  const int main_width = m_surface->get_width();
+  const int main_height = m_surface->get_height();
   set_size_request(main_width, main_height);
 
   queue_draw();
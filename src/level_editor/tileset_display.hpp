@@ -12,6 +12,12 @@ namespace Graal {
   namespace level_editor {
     class window;
 
+    /* Returns the tileset used for levels named level_name: the main tileset
+     * with the longest matching prefix and the other matching tilesets
+     * painted over it */
+    Cairo::RefPtr<Cairo::ImageSurface> compose_tileset(
+        image_cache& cache, tileset_list_type& tilesets, const std::string& level_name);
+
     class tileset_display: public Gtk::DrawingArea {
     public:
       tileset_display(preferences& _prefs, image_cache& cache);
@@ -1,34 +1,38 @@
 #include "undo_diffs.hpp"
 #include "level_map.hpp"
+#include <algorithm>
 
 using namespace Graal;
 
 level_editor::basic_diff::~basic_diff() {}
 
-level_editor::tile_diff::tile_diff(int x, int y, tile_buf& tiles, int layer)
-    : m_layer(layer), m_x(x), m_y(y) {
-  // if (tiles.get_width() == 0 || tiles.get_height() == 0)
+level_editor::tile_diff::tile_diff(int x, int y, BOOST_RV_REF(tile_buf) tiles, int layer)
+    : m_layer(layer), m_x(x), m_y(y), m_tiles(boost::move(tiles)) {
+  // if (m_tiles.get_width() == 0 || m_tiles.get_height() == 0)
   //   throw std::logic_error("trying to construct zero-size tile_diff");
-  m_tiles.swap(tiles);
 }
 
 level_editor::basic_diff* level_editor::tile_diff::apply(
     level_editor::level_map& target) {
   tile_buf buf;
   buf.resize(m_tiles.get_width(), m_tiles.get_height());
-  for (int x = 0; x < m_tiles.get_width(); ++x) {
-    for (int y = 0; y < m_tiles.get_height(); ++y) {
-      const int tx = m_x + x;
-      const int ty = m_y + y;
-
-      // Create a new tile_diff for redoing the action
-      buf.get_tile(x, y) = target.get_tile(tx, ty, m_layer);
-      // Write old tile to board
-      target.set_tile(m_tiles.get_tile(x, y), tx, ty, m_layer);
-    }
+
+  level_map::tile_region region(target,
+    m_x, m_y, m_tiles.get_width(), m_tiles.get_height(), m_layer, true);
+  while (region.next()) {
+    const int x = region.get_region_x();
+    const int y = region.get_region_y();
+    const int width = region.get_span_width();
+
+    tile* tiles = region.get_tiles();
+    const tile* old_tiles = m_tiles.get_row(y) + x;
+    // Create a new tile_diff for redoing the action
+    std::copy(tiles, tiles + width, buf.get_row(y) + x);
+    // Write old tiles to board
+    std::copy(old_tiles, old_tiles + width, tiles);
   }
 
-  return new tile_diff(m_x, m_y, buf, m_layer);
+  return new tile_diff(m_x, m_y, boost::move(buf), m_layer);
 }
 
 level_editor::delete_npc_diff::delete_npc_diff(const level_map::npc_ref& ref, const Graal::npc& npc):
@@ -38,7 +42,10 @@ level_editor::delete_npc_diff::delete_npc_diff(const level_map::npc_ref& ref, co
 }
 
 level_editor::basic_diff* level_editor::delete_npc_diff::apply(level_editor::level_map& target) {
-  target.get_level(m_ref.level_x, m_ref.level_y)->npcs.push_back(m_npc);
+  // Keeps the NPC's id, later diffs refer to it
+  Graal::level& npc_level = *target.get_level(m_ref.level_x, m_ref.level_y);
+  npc_level.npcs.push_back(m_npc);
+  npc_level.hash_object(npc_level.npcs.back());
   return new create_npc_diff(m_ref);
 }
 
@@ -60,10 +67,9 @@ level_editor::npc_diff::npc_diff(const level_map::npc_ref& ref, Graal::npc& npc)
 }
 
 level_editor::basic_diff* level_editor::npc_diff::apply(level_editor::level_map& target) {
-  Graal::npc& npc = *target.get_npc(m_ref);
-  Graal::npc old_npc = npc;
+  Graal::npc old_npc = *target.get_npc(m_ref);
 
-  npc = m_npc;
+  target.update_npc(m_ref, m_npc);
   return new npc_diff(m_ref, old_npc);
 }
 
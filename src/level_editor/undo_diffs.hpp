@@ -14,7 +14,7 @@ namespace Graal {
 
     class tile_diff : public basic_diff {
     public:
-      tile_diff(int x, int y, tile_buf& tiles, int layer);
+      tile_diff(int x, int y, BOOST_RV_REF(tile_buf) tiles, int layer);
       virtual basic_diff* apply(level_map& target);
 
     private:
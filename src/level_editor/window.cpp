@@ -2,6 +2,7 @@
 #include "preferences_display.hpp"
 #include "toolbar_tools_display.hpp"
 #include "layers_control.hpp"
+#include "level_registry.hpp"
 
 #include "gonstruct_config.h"
 #include <iostream>
@@ -107,6 +108,7 @@ level_editor::window::window(preferences& _prefs)
   prefs_display(_prefs),
   opening_levels(false),
   m_image_cache(fs),
+  m_level_registry(new level_registry()),
   m_file_commands(*this, m_header, _prefs),
   m_edit_commands(*this, m_header),
   m_level_commands(*this, m_header, _prefs),
@@ -318,6 +320,7 @@ level_editor::window::create_level_display() {
       m_preferences, m_image_cache,
       default_tile.get_tile()));
   display->set_tile_size(m_tile_width, m_tile_height);
+  display->set_level_registry(m_level_registry);
 
   display->signal_default_tile_changed().connect(
       sigc::mem_fun(this, &window::set_default_tile));
@@ -328,7 +331,8 @@ level_editor::window::create_level_display() {
 }
 
 void level_editor::window::tiles_selected(tile_buf& selection, int x, int y) {
-  get_current_level_display()->drag_selection(selection, x, y);
+  // Emitters pass buffers they don't need anymore
+  get_current_level_display()->drag_selection(boost::move(selection), x, y);
 }
 
 const boost::shared_ptr<level>& level_editor::window::get_current_level() {
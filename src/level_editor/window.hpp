@@ -86,6 +86,8 @@ namespace Graal {
       };
 
       image_cache m_image_cache;
+      // Shares the levels of all open tabs
+      boost::shared_ptr<level_registry> m_level_registry;
 
       header m_header;
       file_commands m_file_commands;
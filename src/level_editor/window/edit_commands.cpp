@@ -49,7 +49,7 @@ void edit_commands::on_action_cut() {
       display.lift_selection();
       buf = display.selection;
     }
-    m_window.copy_cache.reset(new tiles_cache(buf));
+    m_window.copy_cache.reset(new tiles_cache(boost::move(buf)));
   } else {
     npc& selected_npc = *display.get_level_map()->get_npc(display.selected_npc);
     m_window.copy_cache.reset(new npc_cache(selected_npc));
@@ -67,7 +67,7 @@ void edit_commands::on_action_copy() {
       buf = display.selection;
       display.undo();
     }
-    m_window.copy_cache.reset(new tiles_cache(buf));
+    m_window.copy_cache.reset(new tiles_cache(boost::move(buf)));
   } else {
     npc& selected_npc = *display.get_level_map()->get_npc(display.selected_npc);
     m_window.copy_cache.reset(new npc_cache(selected_npc));
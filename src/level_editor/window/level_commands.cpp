@@ -103,7 +103,8 @@ void level_commands::on_action_create_link() {
     link_window.get(new_link);
     if (link_window.run() == Gtk::RESPONSE_OK) {
       new_link = link_window.get_link();
-      m_window.get_current_level()->links.push_back(new_link);
+      m_window.get_current_level()->add_link(new_link);
+      current->mark_current_level_changed();
 
       // update link list & level
       m_link_list.get();